@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,9 +12,22 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// breada() starts reads without waiting for them, for readahead.
+//
+// The buffers are allocated at boot from kalloc() pages by
+// bnew(); there are RAM/BCACHEFRAC bytes worth of them (at least
+// NBUF), or BOOT_NBUF if the kernel was built with one.
+//
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets,
+// each with its own lock, so lookups of different blocks
+// don't contend.  A miss recycles a buffer chosen by a CLOCK
+// sweep over all buffers (see bvictim), which bcache.lock
+// serializes.
 
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
@@ -22,31 +35,150 @@
 #include "fs.h"
 #include "buf.h"
 
+#define NBUCKET 127
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
 struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+  struct spinlock lock;  // held while recycling a buffer
+  struct buf *hand;      // CLOCK hand; all buffers form a ring through cnext
+  int nbuf;
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // Per-bucket lists of buffers, through prev/next.
+  struct {
+    struct spinlock lock;
+    struct buf *head;
+  } bucket[NBUCKET];
 } bcache;
 
-void binit(void) {
+// Return a new buffer that holds no block.  The headers and the
+// BSIZE data blocks are carved from separate runs of whole pages,
+// so the data blocks pack their pages exactly.
+// Only for boot: binit() and initlog().
+struct buf *bnew(void) {
+  static struct buf *hdr, *hdrend;
+  static uchar *data, *dataend;
   struct buf *b;
 
+  acquire(&bcache.lock);
+  if (hdr == hdrend) {
+    if ((hdr = kalloc()) == 0) panic("bnew");
+    memset(hdr, 0, PGSIZE);
+    hdrend = hdr + PGSIZE / sizeof(struct buf);
+  }
+  if (data == dataend) {
+    if ((data = kalloc()) == 0) panic("bnew");
+    dataend = data + PGSIZE;
+  }
+  b = hdr++;
+  b->data = data;
+  data += BSIZE;
+  release(&bcache.lock);
+
+  initsleeplock(&b->lock, "buffer");
+  return b;
+}
+
+void binit(void) {
+  struct buf *b, *last;
+  int i, nbuf;
+
   initlock(&bcache.lock, "bcache");
+  for (i = 0; i < NBUCKET; i++) initlock(&bcache.bucket[i].lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+#ifdef BOOT_NBUF
+  nbuf = BOOT_NBUF;
+#else
+  nbuf = (PHYSTOP - KERNBASE) / BCACHEFRAC / (sizeof(struct buf) + BSIZE);
+#endif
+  if (nbuf < NBUF) nbuf = NBUF;
+
+  // Link the buffers into the clock ring.  They start
+  // out in no bucket, since they hold no block.
+  last = 0;
+  for (i = 0; i < nbuf; i++) {
+    b = bnew();
+    if (last)
+      last->cnext = b;
+    else
+      bcache.hand = b;
+    last = b;
   }
+  last->cnext = bcache.hand;
+  bcache.nbuf = nbuf;
+}
+
+// Look for block on device dev in bucket h.
+// Caller must hold bcache.bucket[h].lock.
+static struct buf *bfind(int h, uint dev, uint blockno) {
+  struct buf *b;
+
+  for (b = bcache.bucket[h].head; b != 0; b = b->next) {
+    if (b->dev == dev && b->blockno == blockno) return b;
+  }
+  return 0;
+}
+
+// Remove b from bucket h, if it is in it.
+// Caller must hold bcache.bucket[h].lock.
+static void bunlink(int h, struct buf *b) {
+  if (b->prev)
+    b->prev->next = b->next;
+  else if (bcache.bucket[h].head == b)
+    bcache.bucket[h].head = b->next;
+  else
+    return;
+  if (b->next) b->next->prev = b->prev;
+  b->next = b->prev = 0;
+}
+
+// Choose an unused buffer to recycle, remove it from its bucket,
+// and return it.  Caller must hold bcache.lock and the lock of
+// bucket h, but no other bucket lock.
+//
+// A CLOCK sweep with two classes of buffer, in the spirit of
+// CLOCK-Pro.  A newly read block is cold and in its test
+// period until the hand first passes it.  Only a use after
+// that, of a buffer nobody holds, counts as a re-reference:
+// bget() then sets b->ref.  Uses during the test period don't
+// count, so the bread() that consumes a readahead block, or a
+// second small read of the same block, doesn't look like
+// reuse.  When the hand finds an unused buffer with ref set
+// it clears ref and makes the buffer hot.  It demotes an
+// unreferenced hot buffer to cold, and recycles an
+// unreferenced cold one whose test period is over.  So a
+// block touched only by a sequential scan of a big file goes
+// on the hand's second visit, while blocks in repeated use
+// (inodes, bitmap, directories) become hot and survive it.
+static struct buf *bvictim(int h) {
+  struct buf *b;
+  int bh;
+
+  // three trips around the ring are enough to end every test
+  // period, clear every ref, and demote every hot buffer.
+  for (int n = 0; n < 3 * bcache.nbuf; n++) {
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+
+    // only recycling changes dev and blockno, and we hold bcache.lock.
+    bh = BHASH(b->dev, b->blockno);
+    if (bh != h) acquire(&bcache.bucket[bh].lock);
+    if (b->refcnt == 0) {
+      if (!b->seen) {
+        b->seen = 1;
+      } else if (b->ref) {
+        b->ref = 0;
+        b->hot = 1;
+      } else if (b->hot) {
+        b->hot = 0;
+      } else {
+        bunlink(bh, b);
+        if (bh != h) release(&bcache.bucket[bh].lock);
+        return b;
+      }
+    }
+    if (bh != h) release(&bcache.bucket[bh].lock);
+  }
+  panic("bget: no buffers");
 }
 
 // Look through buffer cache for block on device dev.
@@ -54,33 +186,46 @@ void binit(void) {
 // In either case, return locked buffer.
 static struct buf *bget(uint dev, uint blockno) {
   struct buf *b;
+  int h = BHASH(dev, blockno);
 
-  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
 
   // Is the block already cached?
-  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-    if (b->dev == dev && b->blockno == blockno) {
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if ((b = bfind(h, dev, blockno)) != 0) {
+    if (b->refcnt == 0 && b->seen) b->ref = 1;
+    b->refcnt++;
+    release(&bcache.bucket[h].lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bcache.bucket[h].lock);
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-    if (b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Only one process at a time may recycle a buffer, so
+  // look again in case someone else cached the block
+  // while we weren't holding the bucket lock.
+  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
+  if ((b = bfind(h, dev, blockno)) == 0) {
+    b = bvictim(h);
+    b->dev = dev;
+    b->blockno = blockno;
+    b->valid = 0;
+    b->ref = 0;
+    b->hot = 0;
+    b->seen = 0;
+    b->prev = 0;
+    b->next = bcache.bucket[h].head;
+    if (b->next) b->next->prev = b;
+    bcache.bucket[h].head = b;
+  } else if (b->refcnt == 0 && b->seen) {
+    b->ref = 1;
   }
-  panic("bget: no buffers");
+  b->refcnt++;
+  release(&bcache.bucket[h].lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -95,42 +240,110 @@ struct buf *bread(uint dev, uint blockno) {
   return b;
 }
 
+// Start reading blocks blocknos[0..n-1] of dev into the cache
+// and return without waiting for them; used for readahead.
+// Blocks that are already cached are skipped.  Each buffer
+// stays locked until its read completes, so a bread() of the
+// block meanwhile waits for the data; biodone() releases it.
+void breada(uint dev, uint *blocknos, int n) {
+  struct buf *b;
+  int h, started = 0;
+
+  for (int i = 0; i < n; i++) {
+    h = BHASH(dev, blocknos[i]);
+    acquire(&bcache.bucket[h].lock);
+    b = bfind(h, dev, blocknos[i]);
+    release(&bcache.bucket[h].lock);
+    if (b) continue;
+
+    b = bget(dev, blocknos[i]);
+    if (b->valid) {
+      brelse(b);
+      continue;
+    }
+    b->async = 1;
+    virtio_disk_submit(b, 0);
+    started = 1;
+  }
+  if (started) virtio_disk_kick();
+}
+
+// Called by the disk driver when it has finished with b.
+// A read started by breada() has no process waiting for it,
+// so mark the data valid and release the buffer here.
+void biodone(struct buf *b) {
+  int h;
+
+  if (b->async == 0) return;
+  b->async = 0;
+  b->valid = 1;
+
+  // brelse() without the holdingsleep() check: the process
+  // that started the read is long gone.
+  releasesleep(&b->lock);
+  h = BHASH(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
+  b->refcnt--;
+  release(&bcache.bucket[h].lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void bwrite(struct buf *b) {
   if (!holdingsleep(&b->lock)) panic("bwrite");
   virtio_disk_rw(b, 1);
 }
 
+// Read or write n buffers that are not in the cache,
+// such as the log's private copies, and wait for them all.
+// Sorts bs by block number so that each run of consecutive
+// blocks goes to the disk as one request.
+// Returns the number of runs.
+int brwv(struct buf **bs, int n, int write) {
+  int i, j, nrun = 0;
+
+  for (i = 1; i < n; i++) {
+    struct buf *b = bs[i];
+    for (j = i; j > 0 && bs[j - 1]->blockno > b->blockno; j--) bs[j] = bs[j - 1];
+    bs[j] = b;
+  }
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && bs[j]->dev == bs[i]->dev && bs[j]->blockno == bs[j - 1]->blockno + 1; j++)
+      ;
+    virtio_disk_submitv(bs + i, j - i, write);
+    nrun++;
+  }
+  virtio_disk_kick();
+  for (i = 0; i < n; i++) virtio_disk_wait(bs[i]);
+  return nrun;
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void brelse(struct buf *b) {
+  int h;
+
   if (!holdingsleep(&b->lock)) panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = BHASH(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
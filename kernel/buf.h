@@ -1,12 +1,17 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // read started by breada(); nobody waits for it
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  char hot;         // reused before the CLOCK hand came round (see bvictim)
+  char ref;         // used again since the last sweep
+  char seen;        // the CLOCK hand has passed it since it was filled
+  struct buf *prev;  // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *cnext; // CLOCK ring of all buffers
+  uchar *data;        // BSIZE bytes, from bnew()
 };
 
@@ -2,20 +2,28 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
+struct logstat;
+struct memstat;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct vma;
 struct stat;
 struct superblock;
 
 // bio.c
 void            binit(void);
+struct buf*     bnew(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+int             brwv(struct buf**, int, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            breada(uint, uint*, int);
+void            biodone(struct buf*);
 
 // console.c
 void            consoleinit(void);
@@ -24,6 +32,13 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             vmaload(struct proc*, uint64, char*);
+int             vmatouch(struct proc*, uint64, uint64);
+void            vmafree(struct vma*);
+void            textinit(void);
+void*           textpage(struct proc*, uint64);
+void            textinval(struct inode*);
+int             textshrink(void);
 
 // file.c
 struct file*    filealloc(void);
@@ -33,6 +48,9 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filepread(struct file*, uint64, int n, uint);
+int             filepwrite(struct file*, uint64, int n, uint);
+int             filesplice(struct file*, struct file*, int);
 
 // fs.c
 void            fsinit(int);
@@ -53,6 +71,7 @@ int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+void            ireadahead(struct inode*, uint, uint);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -61,20 +80,49 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+int             kzerofill(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            kmem_stat(struct memstat*);
 void            kfree(void *);
 void            kinit(void);
+void            kdup(void *);
+int             krefcount(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            log_stat(struct logstat*);
+
+// mmap.c
+uint64          mmap(struct file*, uint64, int, int, uint);
+int             mmapfault(struct proc*, uint64, int);
+int             munmap(uint64, uint64);
+int             mmapfork(struct proc*, struct proc*);
+void            mmapexit(struct proc*);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipesize(struct pipe*);
+int             pipesetsize(struct pipe*, int);
+void            pipestat(struct pipe*, struct stat*);
+int             pipewclaim(struct pipe*, int, char**);
+void            pipewdone(struct pipe*, int);
+int             piperclaim(struct pipe*, int, char**, int);
+void            piperdone(struct pipe*, int);
+
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
 
 // printf.c
 #ifdef TEST
@@ -95,7 +143,7 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+int             growproc(int, int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -103,11 +151,14 @@ struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+int             procasid(struct proc*);
+void            tlbflush(pagetable_t, uint64, uint64);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread(char*, void (*)(void));
 int             wait(uint64,int);
 void            wakeup(void*);
 void            yield(void);
@@ -173,10 +224,13 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+int             uvmfault(struct proc*, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t*          walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -191,6 +245,10 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+void            virtio_disk_kick(void);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -6,8 +6,54 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+// exec() doesn't read the program into memory.  It records
+// each segment in a vma, and uvmfault() reads a page in
+// with vmaload() the first time the program uses it.
+//
+// Pages that hold nothing but file data are kept in a cache
+// shared by every process that runs the same program, and are
+// mapped copy-on-write; textpage() returns them.  Writing or
+// truncating the file drops its pages from the cache.
+//
+// A file's pages are chained in the hash bucket for the file,
+// under the bucket's lock, so a lookup only looks at pages of
+// files in that bucket.  text.lock guards the free list and
+// replacement; it is taken before any bucket lock.
+
+#define NTEXTHASH 61
+#define TEXTHASH(dev, inum) (((dev) * 31 + (inum)) % NTEXTHASH)
+
+struct textent {
+  uint dev;
+  uint inum;
+  uint off;              // file offset of the page
+  void *pa;              // the page, or 0 if the entry is free
+  struct textent *next;  // in its bucket, or on the free list
+};
+
+struct {
+  struct spinlock lock;
+  struct textent page[NTEXT];
+  struct textent *free;
+  int hand;  // next entry to replace
+  struct {
+    struct spinlock lock;
+    struct textent *head;
+  } bucket[NTEXTHASH];
+} text;
+
+void textinit(void) {
+  initlock(&text.lock, "text");
+  for (int i = 0; i < NTEXTHASH; i++) initlock(&text.bucket[i].lock, "textbucket");
+  for (int i = NTEXT - 1; i >= 0; i--) {
+    text.page[i].next = text.free;
+    text.free = &text.page[i];
+  }
+}
 
 int exec(char *path, char **argv) {
   char *s, *last;
@@ -16,9 +62,13 @@ int exec(char *path, char **argv) {
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA];
+  int nvma = 0;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  memset(vma, 0, sizeof(vma));
+
   begin_op();
 
   if ((ip = namei(path)) == 0) {
@@ -33,17 +83,23 @@ int exec(char *path, char **argv) {
 
   if ((pagetable = proc_pagetable(p)) == 0) goto bad;
 
-  // Load program into memory.
+  // Map the program's segments, to be read in on demand.
   for (i = 0, off = elf.phoff; i < elf.phnum; i++, off += sizeof(ph)) {
     if (readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph)) goto bad;
     if (ph.type != ELF_PROG_LOAD) continue;
     if (ph.memsz < ph.filesz) goto bad;
     if (ph.vaddr + ph.memsz < ph.vaddr) goto bad;
-    uint64 sz1;
-    if ((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0) goto bad;
-    sz = sz1;
+    if (ph.vaddr + ph.memsz >= TRAPFRAME) goto bad;
     if (ph.vaddr % PGSIZE != 0) goto bad;
-    if (loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0) goto bad;
+    if (ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size) goto bad;
+    if (nvma == NVMA) goto bad;
+    vma[nvma].start = ph.vaddr;
+    vma[nvma].end = ph.vaddr + ph.memsz;
+    vma[nvma].ip = idup(ip);
+    vma[nvma].off = ph.off;
+    vma[nvma].filesz = ph.filesz;
+    nvma++;
+    if (ph.vaddr + ph.memsz > sz) sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -90,12 +146,19 @@ int exec(char *path, char **argv) {
   safestrcpy(p->name, last, sizeof(p->name));
 
   // Commit to the user image.
+  mmapexit(p);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->asidgen = 0;  // the old ASID's translations are stale
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp;          // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  // drop the old vmas in place, to keep exec's stack frame small.
+  begin_op();
+  vmafree(p->vma);
+  end_op();
+  memmove(p->vma, vma, sizeof(vma));
 
   return argc;  // this ends up in a0, the first argument to main(argc, argv)
 
@@ -105,28 +168,203 @@ bad:
     iunlockput(ip);
     end_op();
   }
+  if (nvma > 0) {
+    begin_op();
+    vmafree(vma);
+    end_op();
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz) {
-  uint i, n;
-  uint64 pa;
-
-  if ((va % PGSIZE) != 0) panic("loadseg: va must be page aligned");
-
-  for (i = 0; i < sz; i += PGSIZE) {
-    pa = walkaddr(pagetable, va + i);
-    if (pa == 0) panic("loadseg: address should exist");
-    if (sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if (readi(ip, 0, (uint64)pa, offset + i, n) != n) return -1;
+// Fill mem with the page at va of p's memory, reading
+// whatever parts of it come from p's file-backed ranges.
+// mem must already be zeroed.
+// Returns 0 on success, -1 if a file can't be read.
+int vmaload(struct proc *p, uint64 va, char *mem) {
+  struct vma *v;
+  uint64 a, b;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->ip == 0) continue;
+    a = va > v->start ? va : v->start;
+    b = v->start + v->filesz;
+    if (b > va + PGSIZE) b = va + PGSIZE;
+    if (a >= b) continue;
+    ilock(v->ip);
+    int n = readi(v->ip, 0, (uint64)mem + (a - va), v->off + (a - v->start), b - a);
+    iunlock(v->ip);
+    if (n != b - a) return -1;
   }
+  return 0;
+}
+
+// Read in any pages of [va, va+n) that come from p's files and
+// aren't mapped yet.  Called before code that copies to or from
+// user memory while holding a spinlock, or while holding an
+// inode lock that vmaload() might need.  Returns 0, or -1
+// if a page can't be read in, so the copy would fault.
+int vmatouch(struct proc *p, uint64 va, uint64 n) {
+  struct vma *v;
+  uint64 a, end;
 
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->ip == 0) continue;
+    a = PGROUNDDOWN(va > v->start ? va : v->start);
+    end = va + n < v->end ? va + n : v->end;
+    for (; a < end; a += PGSIZE)
+      if (walkaddr(p->pagetable, a) == 0 && uvmfault(p, a, 0) < 0) return -1;
+  }
   return 0;
 }
+
+// Drop the file references of a process's file-backed ranges.
+// Caller must be in a transaction, for iput().
+void vmafree(struct vma *vma) {
+  for (int i = 0; i < NVMA; i++) {
+    if (vma[i].ip) {
+      iput(vma[i].ip);
+      vma[i].ip = 0;
+    }
+  }
+}
+
+// Return the cached page at offset off of the file dev/inum,
+// with a reference for the caller, or 0.
+static void *textlookup(uint dev, uint inum, uint off) {
+  int h = TEXTHASH(dev, inum);
+  struct textent *e;
+  void *pa = 0;
+
+  acquire(&text.bucket[h].lock);
+  for (e = text.bucket[h].head; e; e = e->next) {
+    if (e->dev == dev && e->inum == inum && e->off == off) {
+      pa = e->pa;
+      kdup(pa);
+      break;
+    }
+  }
+  release(&text.bucket[h].lock);
+  return pa;
+}
+
+// Drop cache entry e and put it on the free list.
+// Caller holds text.lock and e's bucket lock.
+static void textdrop(struct textent *e) {
+  struct textent **pp;
+
+  for (pp = &text.bucket[TEXTHASH(e->dev, e->inum)].head; *pp != e; pp = &(*pp)->next)
+    ;
+  *pp = e->next;
+  kfree(e->pa);
+  e->pa = 0;
+  e->next = text.free;
+  text.free = e;
+}
+
+// Return a page of p's program for va that can be shared
+// copy-on-write with other processes running the same program,
+// with a reference for the caller.  Returns 0 if the page at va
+// isn't wholly file data, or can't be read; the caller must
+// then make a private page with vmaload().
+void *textpage(struct proc *p, uint64 va) {
+  struct vma *v;
+  struct inode *ip;
+  struct textent *e;
+  void *pa, *mem;
+  uint off;
+  int h;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++)
+    if (v->ip && va >= v->start && va + PGSIZE <= v->start + v->filesz) break;
+  if (v == &p->vma[NVMA]) return 0;
+  ip = v->ip;
+  off = v->off + (va - v->start);
+
+  if ((pa = textlookup(ip->dev, ip->inum, off)) != 0) return pa;
+
+  if ((mem = kalloc()) == 0) return 0;
+  ilock(ip);
+  if (readi(ip, 0, (uint64)mem, off, PGSIZE) != PGSIZE) {
+    iunlock(ip);
+    kfree(mem);
+    return 0;
+  }
+  // add it while holding ip->lock, so that a write to
+  // the file can't come between the read and the add.
+  if ((pa = textlookup(ip->dev, ip->inum, off)) != 0) {
+    iunlock(ip);
+    kfree(mem);  // another process read it first.
+    return pa;
+  }
+  acquire(&text.lock);
+  if (text.free == 0) {
+    e = &text.page[text.hand];
+    text.hand = (text.hand + 1) % NTEXT;
+    h = TEXTHASH(e->dev, e->inum);
+    acquire(&text.bucket[h].lock);
+    textdrop(e);
+    release(&text.bucket[h].lock);
+  }
+  e = text.free;
+  text.free = e->next;
+  e->dev = ip->dev;
+  e->inum = ip->inum;
+  e->off = off;
+  e->pa = mem;
+  kdup(mem);  // the cache keeps kalloc()'s reference.
+  h = TEXTHASH(ip->dev, ip->inum);
+  acquire(&text.bucket[h].lock);
+  e->next = text.bucket[h].head;
+  text.bucket[h].head = e;
+  release(&text.bucket[h].lock);
+  release(&text.lock);
+  iunlock(ip);
+  return mem;
+}
+
+// ip's contents are about to change; forget its cached pages.
+// Processes that have them mapped keep them.
+// Caller must hold ip->lock.
+void textinval(struct inode *ip) {
+  int h = TEXTHASH(ip->dev, ip->inum);
+  struct textent *e, *next;
+
+  // pages of ip are only added with ip->lock held, so if
+  // there are none now, none will appear before we return.
+  acquire(&text.bucket[h].lock);
+  for (e = text.bucket[h].head; e && (e->dev != ip->dev || e->inum != ip->inum); e = e->next)
+    ;
+  release(&text.bucket[h].lock);
+  if (e == 0) return;
+
+  acquire(&text.lock);
+  acquire(&text.bucket[h].lock);
+  for (e = text.bucket[h].head; e; e = next) {
+    next = e->next;
+    if (e->dev == ip->dev && e->inum == ip->inum) textdrop(e);
+  }
+  release(&text.bucket[h].lock);
+  release(&text.lock);
+}
+
+// Free cached pages that no process has mapped.
+// Called by kalloc() when memory runs out.
+// Returns the number of pages freed.
+int textshrink(void) {
+  struct textent *e;
+  int h, n = 0;
+
+  acquire(&text.lock);
+  for (e = text.page; e < &text.page[NTEXT]; e++) {
+    if (e->pa == 0) continue;
+    h = TEXTHASH(e->dev, e->inum);
+    acquire(&text.bucket[h].lock);
+    if (krefcount(e->pa) == 1) {
+      textdrop(e);
+      n++;
+    }
+    release(&text.bucket[h].lock);
+  }
+  release(&text.lock);
+  return n;
+}
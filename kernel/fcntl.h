@@ -3,3 +3,19 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+
+// fcntl() commands
+#define F_GETPIPE_SZ 1  // pipe buffer capacity in bytes
+#define F_SETPIPE_SZ 2  // resize a pipe's buffer; returns the new capacity
+
+// mmap() protection
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+// mmap() flags
+#define MAP_SHARED  0x1  // stores go to the file
+#define MAP_PRIVATE 0x2  // stores stay in this process
+
+// sbrkx() flags
+#define SBRK_POPULATE 0x1  // allocate the new pages now, not on first use
@@ -14,27 +14,39 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+// open files come from a slab cache, at most NFILE at a time.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
+  int nfile;
 } ftable;
 
-void fileinit(void) { initlock(&ftable.lock, "ftable"); }
+void fileinit(void) {
+  initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
+}
 
 // Allocate a file structure.
 struct file *filealloc(void) {
   struct file *f;
 
   acquire(&ftable.lock);
-  for (f = ftable.file; f < ftable.file + NFILE; f++) {
-    if (f->ref == 0) {
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if (ftable.nfile == NFILE) {
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.nfile++;
   release(&ftable.lock);
-  return 0;
+
+  if ((f = kmem_cache_alloc(ftable.cache)) == 0) {
+    acquire(&ftable.lock);
+    ftable.nfile--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -59,7 +71,9 @@ void fileclose(struct file *f) {
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
+  ftable.nfile--;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if (ff.type == FD_PIPE) {
     pipeclose(ff.pipe, ff.writable);
@@ -83,9 +97,39 @@ int filestat(struct file *f, uint64 addr) {
     if (copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0) return -1;
     return 0;
   }
+  if (f->type == FD_PIPE) {
+    pipestat(f->pipe, &st);
+    if (copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0) return -1;
+    return 0;
+  }
   return -1;
 }
 
+// Sequential readahead for a read of f that started at off.
+// If it carried on where the previous read stopped, grow the
+// window (doubling up to READAHEAD blocks) and start reading
+// the window's blocks beyond f->off into the buffer cache;
+// otherwise the access is random and the window collapses.
+// Caller must hold f->ip->lock.
+static void readahead(struct file *f, uint off) {
+  uint bn, end;
+
+  if (off != f->ra_off) {
+    f->ra_win = 0;
+  } else {
+    f->ra_win = f->ra_win ? f->ra_win * 2 : 2;
+    if (f->ra_win > READAHEAD) f->ra_win = READAHEAD;
+    bn = f->off / BSIZE;
+    if (f->ra_next < bn) f->ra_next = bn;
+    end = bn + f->ra_win;
+    if (f->ra_next < end) {
+      ireadahead(f->ip, f->ra_next, end - f->ra_next);
+      f->ra_next = end;
+    }
+  }
+  f->ra_off = f->off;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int fileread(struct file *f, uint64 addr, int n) {
@@ -93,6 +137,7 @@ int fileread(struct file *f, uint64 addr, int n) {
 
   if (f->readable == 0) return -1;
 
+  if (vmatouch(myproc(), addr, n) < 0) return -1;
   if (f->type == FD_PIPE) {
     r = piperead(f->pipe, addr, n);
   } else if (f->type == FD_DEVICE) {
@@ -100,7 +145,11 @@ int fileread(struct file *f, uint64 addr, int n) {
     r = devsw[f->major].read(1, addr, n);
   } else if (f->type == FD_INODE) {
     ilock(f->ip);
-    if ((r = readi(f->ip, 1, addr, f->off, n)) > 0) f->off += r;
+    uint off = f->off;
+    if ((r = readi(f->ip, 1, addr, off, n)) > 0) {
+      f->off += r;
+      readahead(f, off);
+    }
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -109,45 +158,163 @@ int fileread(struct file *f, uint64 addr, int n) {
   return r;
 }
 
+// Write n bytes from user address addr to f's inode at *off,
+// advancing *off as the data goes in.  Returns n, or -1.
+static int inodewrite(struct file *f, uint64 addr, int n, uint *off) {
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size, including
+  // i-node, indirect block, allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
+  int i = 0, r;
+  while (i < n) {
+    int n1 = n - i;
+    if (n1 > max) n1 = max;
+
+    begin_op();
+    ilock(f->ip);
+    if ((r = writei(f->ip, 1, addr + i, *off, n1)) > 0) *off += r;
+    iunlock(f->ip);
+    end_op();
+
+    if (r < 0) break;
+    if (r != n1) panic("short filewrite");
+    i += r;
+  }
+  return i == n ? n : -1;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int filewrite(struct file *f, uint64 addr, int n) {
-  int r, ret = 0;
+  int ret = 0;
 
   if (f->writable == 0) return -1;
 
+  if (vmatouch(myproc(), addr, n) < 0) return -1;
   if (f->type == FD_PIPE) {
     ret = pipewrite(f->pipe, addr, n);
   } else if (f->type == FD_DEVICE) {
     if (f->major < 0 || f->major >= NDEV || !devsw[f->major].write) return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if (f->type == FD_INODE) {
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
-    int i = 0;
-    while (i < n) {
-      int n1 = n - i;
-      if (n1 > max) n1 = max;
+    ret = inodewrite(f, addr, n, &f->off);
+  } else {
+    panic("filewrite");
+  }
+
+  return ret;
+}
+
+// Read from inode-backed file f at offset off, without
+// using or changing f's own offset.
+// addr is a user virtual address.
+int filepread(struct file *f, uint64 addr, int n, uint off) {
+  int r;
 
+  if (f->readable == 0 || f->type != FD_INODE || n < 0) return -1;
+
+  if (vmatouch(myproc(), addr, n) < 0) return -1;
+  ilock(f->ip);
+  r = readi(f->ip, 1, addr, off, n);
+  iunlock(f->ip);
+  return r;
+}
+
+// Write to inode-backed file f at offset off, without
+// using or changing f's own offset.
+// addr is a user virtual address.
+int filepwrite(struct file *f, uint64 addr, int n, uint off) {
+  if (f->writable == 0 || f->type != FD_INODE || n < 0) return -1;
+
+  if (vmatouch(myproc(), addr, n) < 0) return -1;
+  return inodewrite(f, addr, n, &off);
+}
+
+// Move up to n bytes from file in to file out without copying
+// them through user space: from a file into a pipe, from a pipe
+// into a file, or from one pipe to another.  File data moves
+// straight between the buffer cache and the pipe's ring.
+// Like read(), a pipe source waits only for the first byte.
+// Returns the number of bytes moved, or -1 if an error
+// stopped it before any moved.
+int filesplice(struct file *in, struct file *out, int n) {
+  int err = 0, m, r, tot = 0;
+  char *buf;
+
+  if (in->readable == 0 || out->writable == 0 || n < 0) return -1;
+
+  if (in->type == FD_INODE && out->type == FD_PIPE) {
+    while (tot < n) {
+      if ((m = pipewclaim(out->pipe, n - tot, &buf)) < 0) {
+        err = 1;
+        break;
+      }
+      ilock(in->ip);
+      uint off = in->off;
+      if ((r = readi(in->ip, 0, (uint64)buf, off, m)) > 0) {
+        in->off += r;
+        readahead(in, off);
+      }
+      iunlock(in->ip);
+      pipewdone(out->pipe, r > 0 ? r : 0);
+      if (r < 0) err = 1;
+      if (r <= 0) break;
+      tot += r;
+      if (r < m) break;  // end of file
+    }
+  } else if (in->type == FD_PIPE && out->type == FD_INODE) {
+    // a few blocks at a time, as in filewrite().
+    int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
+    while (tot < n) {
+      if ((m = piperclaim(in->pipe, n - tot < max ? n - tot : max, &buf, tot == 0)) <= 0) {
+        err = m < 0;
+        break;
+      }
       begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0) f->off += r;
-      iunlock(f->ip);
+      ilock(out->ip);
+      if ((r = writei(out->ip, 0, (uint64)buf, out->off, m)) > 0) out->off += r;
+      iunlock(out->ip);
       end_op();
-
-      if (r < 0) break;
-      if (r != n1) panic("short filewrite");
-      i += r;
+      piperdone(in->pipe, r > 0 ? r : 0);
+      if (r < 0) {
+        err = 1;
+        break;
+      }
+      if (r != m) panic("short filesplice");
+      tot += r;
+    }
+  } else if (in->type == FD_PIPE && out->type == FD_PIPE && in->pipe != out->pipe) {
+    // never sleep holding a claim on one pipe while waiting for
+    // the other: claim room in out first, and take from in only
+    // what is there; to wait for data, let go of out.
+    char *dst;
+    while (tot < n) {
+      if ((m = pipewclaim(out->pipe, n - tot, &dst)) < 0) {
+        err = 1;
+        break;
+      }
+      if ((r = piperclaim(in->pipe, m, &buf, 0)) <= 0) {
+        pipewdone(out->pipe, 0);
+        if (r < 0) err = 1;
+        if (r < 0 || tot > 0) break;
+        if ((r = piperclaim(in->pipe, 1, &buf, 1)) <= 0) {  // end of file, or killed
+          err = r < 0;
+          break;
+        }
+        piperdone(in->pipe, 0);
+        continue;
+      }
+      memmove(dst, buf, r);
+      piperdone(in->pipe, r);
+      pipewdone(out->pipe, r);
+      tot += r;
     }
-    ret = (i == n ? n : -1);
   } else {
-    panic("filewrite");
+    return -1;
   }
 
-  return ret;
+  return tot == 0 && err ? -1 : tot;
 }
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint ra_off;       // FD_INODE: offset at which a sequential read would continue
+  uint ra_next;      // FD_INODE: first block not yet read ahead
+  uint ra_win;       // FD_INODE: readahead window, in blocks
   short major;       // FD_DEVICE
 };
 
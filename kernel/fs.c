@@ -374,6 +374,8 @@ void itrunc(struct inode *ip) {
   struct buf *bp;
   uint *a;
 
+  textinval(ip);
+
   for (i = 0; i < NDIRECT; i++) {
     if (ip->addrs[i]) {
       bfree(ip->dev, ip->addrs[i]);
@@ -396,6 +398,19 @@ void itrunc(struct inode *ip) {
   iupdate(ip);
 }
 
+// Start reading blocks bn..bn+n-1 of ip into the buffer cache,
+// without waiting for them.  Stops at the end of the file, so
+// bmap() never has to allocate.
+// Caller must hold ip->lock.
+void ireadahead(struct inode *ip, uint bn, uint n) {
+  uint blocks[READAHEAD];
+  uint nb = (ip->size + BSIZE - 1) / BSIZE;
+  int k = 0;
+
+  for (; n > 0 && bn < nb && k < READAHEAD; bn++, n--) blocks[k++] = bmap(ip, bn);
+  if (k > 0) breada(ip->dev, blocks, k);
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void stati(struct inode *ip, struct stat *st) {
@@ -404,6 +419,7 @@ void stati(struct inode *ip, struct stat *st) {
   st->type = ip->type;
   st->nlink = ip->nlink;
   st->size = ip->size;
+  st->cap = 0;
 }
 
 // Read data from inode.
@@ -440,6 +456,7 @@ int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
   if (off > ip->size || off + n < off) return -1;
   if (off + n > MAXFILE * BSIZE) return -1;
 
+  textinval(ip);
   for (tot = 0; tot < n; tot += m, off += m, src += m) {
     bp = bread(ip->dev, bmap(ip, off / BSIZE));
     m = min(n - tot, BSIZE - off % BSIZE);
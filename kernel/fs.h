@@ -24,6 +24,9 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
+// most data blocks the log can hold: one header block's worth of block numbers.
+#define LOGMAX (BSIZE / sizeof(uint) - 1)
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
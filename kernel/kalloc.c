@@ -1,6 +1,26 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or with kalloc_pages() physically contiguous blocks
+// of a power-of-two number of pages.
+//
+// Free memory is managed by a buddy allocator: a block of 2^k
+// pages is aligned to 2^k pages, and when it and its buddy (the
+// other half of the enclosing 2^(k+1) block) are both free they
+// are merged.  Each CPU keeps a small cache of free single pages
+// so that the common kalloc()/kfree() path takes only an
+// uncontended per-CPU lock. Caches refill from and spill to the
+// buddy allocator KBATCH pages at a time; a CPU whose cache and
+// the buddy allocator are both empty steals from another CPU.
+//
+// Each page has a reference count so that copy-on-write
+// fork can share user pages; kfree() only frees a page
+// when its last reference goes away.
+//
+// Idle CPUs zero free pages ahead of time into a small pool,
+// from which kalloc_zeroed() hands out pages that need no memset.
+// Building with KALLOC_DEBUG fills allocated and freed pages
+// with junk to catch dangling references.
 
 #include "types.h"
 #include "param.h"
@@ -8,50 +28,303 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
-
-void freerange(void *pa_start, void *pa_end);
+#include "memstat.h"
 
 extern char end[];  // first address after kernel.
                     // defined by kernel.ld.
 
+#define KBATCHORDER 5
+#define KBATCH (1 << KBATCHORDER)  // pages moved between a CPU cache and the pool at once
+#define KCACHEMAX (2 * KBATCH)     // spill to the pool above this many cached pages
+#define KMAXORDER (NORDER - 1)     // largest block is 2^KMAXORDER pages
+
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PGINDEX(pa) (((uint64)(pa)-KERNBASE) / PGSIZE)
+#define PGADDR(i) ((char *)(KERNBASE + (uint64)(i)*PGSIZE))
+
 struct run {
   struct run *next;
+  struct run *prev;  // buddy lists only
 };
 
+// global buddy allocator.  free[k] is a circular list of free
+// blocks of 2^k pages.  pages from brk up to PHYSTOP have never
+// been allocated; they join the allocator as it runs dry, so
+// boot need not touch every page of RAM.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run free[NORDER];
+  int nfree[NORDER];
+  char *brk;
 } kmem;
 
+// k+1 for the first page of a free block of 2^k pages
+// in the buddy allocator, 0 for every other page.
+// kmem.lock must be held.
+static uchar pgorder[NPAGE];
+
+// per-CPU caches, indexed by cpuid().
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+} kcpu[NCPU];
+
+// pages zeroed by idle CPUs, for kalloc_zeroed().
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+} kzero;
+
+// reference counts of allocated pages, updated atomically.
+#define PGREF(pa) pgref[PGINDEX(pa)]
+static int pgref[NPAGE];
+
 void kinit() {
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void *)PHYSTOP);
+  for (int k = 0; k < NORDER; k++) kmem.free[k].next = kmem.free[k].prev = &kmem.free[k];
+  for (int i = 0; i < NCPU; i++) initlock(&kcpu[i].lock, "kmem_cpu");
+  initlock(&kzero.lock, "kmem_zero");
+  kmem.brk = (char *)PGROUNDUP((uint64)end);
 }
 
-void freerange(void *pa_start, void *pa_end) {
-  char *p;
-  p = (char *)PGROUNDUP((uint64)pa_start);
-  for (; p + PGSIZE <= (char *)pa_end; p += PGSIZE) kfree(p);
+// Detach the first n pages of *list and return them.
+// The caller must hold the lock protecting *list,
+// which must contain at least n pages.
+static struct run *takepages(struct run **list, int n) {
+  struct run *first, *last;
+
+  first = last = *list;
+  for (int i = 1; i < n; i++) last = last->next;
+  *list = last->next;
+  last->next = 0;
+  return first;
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
-void kfree(void *pa) {
+// Put a free block of 2^k pages on its list.
+// The caller must hold kmem.lock, as for the buddy functions below.
+static void buddypush(struct run *r, int k) {
+  struct run *head = &kmem.free[k];
+
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+  kmem.nfree[k]++;
+  pgorder[PGINDEX(r)] = k + 1;
+}
+
+// Take a free block of 2^k pages off its list.
+static void buddyremove(struct run *r, int k) {
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nfree[k]--;
+  pgorder[PGINDEX(r)] = 0;
+}
+
+// Free a block of 2^k pages, merging it with its free buddies.
+static void buddyfree(void *pa, int k) {
+  uint64 i = PGINDEX(pa);
+
+  for (; k < KMAXORDER; k++) {
+    uint64 b = i ^ (1L << k);
+    if (b >= NPAGE || pgorder[b] != k + 1) break;
+    buddyremove((struct run *)PGADDR(b), k);
+    i &= ~(1L << k);
+  }
+  buddypush((struct run *)PGADDR(i), k);
+}
+
+// Add the never-allocated pages at kmem.brk to the allocator,
+// as the largest aligned block that fits below PHYSTOP.
+// Returns 0 if there are none left.
+static int buddygrow(void) {
+  uint64 i = PGINDEX(kmem.brk);
+  int k;
+
+  if (i >= NPAGE) return 0;
+  for (k = 0; k < KMAXORDER && (i & ((2L << k) - 1)) == 0 && i + (2L << k) <= NPAGE; k++)
+    ;
+  kmem.brk += (uint64)PGSIZE << k;
+  buddyfree(PGADDR(i), k);
+  return 1;
+}
+
+// Allocate a block of 2^k pages, splitting a larger one if
+// need be.  Returns 0 if there is none.
+static struct run *buddyalloc(int k) {
+  struct run *r;
+  int j;
+
+  for (;;) {
+    for (j = k; j <= KMAXORDER && kmem.nfree[j] == 0; j++)
+      ;
+    if (j <= KMAXORDER) break;
+    if (!buddygrow()) return 0;
+  }
+  r = kmem.free[j].next;
+  buddyremove(r, j);
+  // free the halves we don't need.
+  while (j > k) {
+    j--;
+    buddypush((struct run *)((char *)r + ((uint64)PGSIZE << j)), j);
+  }
+  return r;
+}
+
+// Return up to n single pages from the buddy allocator, as a list,
+// or 0 if it is empty.  Sets *got to the number of pages returned.
+static struct run *poolget(int n, int *got) {
+  struct run *r, *list = 0;
+
+  acquire(&kmem.lock);
+  *got = 0;
+  if (n == KBATCH && (r = buddyalloc(KBATCHORDER)) != 0) {
+    // one block, rather than n pages from all over.
+    for (int i = n - 1; i >= 0; i--) {
+      struct run *p = (struct run *)((char *)r + i * PGSIZE);
+      p->next = list;
+      list = p;
+    }
+    *got = n;
+  } else {
+    for (; *got < n && (r = buddyalloc(0)) != 0; (*got)++) {
+      r->next = list;
+      list = r;
+    }
+  }
+  release(&kmem.lock);
+  return list;
+}
+
+// Hand a list of single pages back to the buddy allocator.
+static void poolput(struct run *r) {
+  struct run *next;
+
+  acquire(&kmem.lock);
+  for (; r; r = next) {
+    next = r->next;
+    buddyfree(r, 0);
+  }
+  release(&kmem.lock);
+}
+
+// Take half of some other CPU's cached pages.
+// Sets *got to the number of pages returned.
+static struct run *steal(int me, int *got) {
   struct run *r;
+  int n;
+
+  for (int i = 1; i < NCPU; i++) {
+    int id = (me + i) % NCPU;
+    acquire(&kcpu[id].lock);
+    if (kcpu[id].nfree > 0) {
+      n = (kcpu[id].nfree + 1) / 2;
+      r = takepages(&kcpu[id].freelist, n);
+      kcpu[id].nfree -= n;
+      release(&kcpu[id].lock);
+      *got = n;
+      return r;
+    }
+    release(&kcpu[id].lock);
+  }
+  *got = 0;
+  return 0;
+}
+
+// Add a reference to an allocated page, which
+// kfree() will then have to drop before the page is freed.
+void kdup(void *pa) {
+  if (((uint64)pa % PGSIZE) != 0 || (char *)pa < end || (uint64)pa >= PHYSTOP) panic("kdup");
+  if (__sync_fetch_and_add(&PGREF(pa), 1) < 1) panic("kdup: free page");
+}
+
+// Return the number of references to an allocated page.
+int krefcount(void *pa) { return __atomic_load_n(&PGREF(pa), __ATOMIC_RELAXED); }
+
+// Drop a reference to the page of physical memory pointed at by v,
+// which should have been returned by a call
+// to kalloc(), and free it if that was the last.
+void kfree(void *pa) {
+  struct run *r, *spill = 0;
+  int ref;
 
   if (((uint64)pa % PGSIZE) != 0 || (char *)pa < end || (uint64)pa >= PHYSTOP) panic("kfree");
 
+  if ((ref = __sync_sub_and_fetch(&PGREF(pa), 1)) > 0) return;
+  if (ref < 0) panic("kfree: free page");
+
+#ifdef KALLOC_DEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run *)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  int id = cpuid();
+  acquire(&kcpu[id].lock);
+  r->next = kcpu[id].freelist;
+  kcpu[id].freelist = r;
+  if (++kcpu[id].nfree > KCACHEMAX) {
+    spill = takepages(&kcpu[id].freelist, KBATCH);
+    kcpu[id].nfree -= KBATCH;
+  }
+  release(&kcpu[id].lock);
+  pop_off();
+
+  if (spill) poolput(spill);
+}
+
+// Take a free page from this CPU's cache, refilling it if need be.
+// Returns 0 if there are no free pages.
+static struct run *kget(void) {
+  struct run *r;
+  int n;
+
+  push_off();
+  int id = cpuid();
+
+  acquire(&kcpu[id].lock);
+  r = kcpu[id].freelist;
+  if (r) {
+    kcpu[id].freelist = r->next;
+    kcpu[id].nfree--;
+  }
+  release(&kcpu[id].lock);
+
+  if (r == 0) {
+    // refill from the global pool, or failing that, from a neighbour.
+    if ((r = poolget(KBATCH, &n)) == 0) r = steal(id, &n);
+    if (r && n > 1) {
+      acquire(&kcpu[id].lock);
+      struct run *last;
+      for (last = r->next; last->next; last = last->next)
+        ;
+      last->next = kcpu[id].freelist;
+      kcpu[id].freelist = r->next;
+      kcpu[id].nfree += n - 1;
+      release(&kcpu[id].lock);
+    }
+  }
+  pop_off();
+  return r;
+}
+
+// Take a page from the zeroed pool, or return 0 if it is empty.
+static struct run *zget(void) {
+  struct run *r;
+
+  if (__atomic_load_n(&kzero.nfree, __ATOMIC_RELAXED) == 0) return 0;
+  acquire(&kzero.lock);
+  if ((r = kzero.freelist) != 0) {
+    kzero.freelist = r->next;
+    kzero.nfree--;
+  }
+  release(&kzero.lock);
+  if (r) r->next = 0;  // the rest of the page is already zero
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -60,11 +333,131 @@ void kfree(void *pa) {
 void *kalloc(void) {
   struct run *r;
 
+  r = kget();
+  if (r == 0) r = zget();
+
+  // out of memory: give back program pages
+  // that only the page cache is holding.
+  if (r == 0 && textshrink() > 0) return kalloc();
+
+  if (r) {
+#ifdef KALLOC_DEBUG
+    memset((char *)r, 5, PGSIZE);  // fill with junk
+#endif
+    PGREF(r) = 1;
+  }
+  return (void *)r;
+}
+
+// Allocate a page of physical memory filled with zeros,
+// from the pool if it can, otherwise by zeroing a new one.
+void *kalloc_zeroed(void) {
+  struct run *r;
+
+  if ((r = zget()) != 0) {
+    PGREF(r) = 1;
+    return (void *)r;
+  }
+  if ((r = kalloc()) != 0) memset((char *)r, 0, PGSIZE);
+  return (void *)r;
+}
+
+// Zero one free page into the pool, if it is short.
+// Called by the scheduler on idle CPUs, which
+// then look again for something to run.
+// Returns 1 if it zeroed a page.
+int kzerofill(void) {
+  struct run *r;
+
+  if (__atomic_load_n(&kzero.nfree, __ATOMIC_RELAXED) >= NZEROPAGE) return 0;
+  if ((r = kget()) == 0) return 0;
+  memset((char *)r, 0, PGSIZE);
+  acquire(&kzero.lock);
+  r->next = kzero.freelist;
+  kzero.freelist = r;
+  kzero.nfree++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Give every CPU's cached pages, and the zeroed pool, back to
+// the buddy allocator, so that they can merge into larger blocks.
+static void kdrain(void) {
+  struct run *r;
+
+  for (int id = 0; id < NCPU; id++) {
+    acquire(&kcpu[id].lock);
+    r = kcpu[id].freelist;
+    kcpu[id].freelist = 0;
+    kcpu[id].nfree = 0;
+    release(&kcpu[id].lock);
+    if (r) poolput(r);
+  }
+
+  acquire(&kzero.lock);
+  r = kzero.freelist;
+  kzero.freelist = 0;
+  kzero.nfree = 0;
+  release(&kzero.lock);
+  if (r) poolput(r);
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size.  Returns 0 if the memory cannot be allocated.
+// Free with kfree_pages(pa, order).
+void *kalloc_pages(int order) {
+  struct run *r;
+
+  if (order == 0) return kalloc();
+  if (order < 0 || order > KMAXORDER) return 0;
+
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if (r) kmem.freelist = r->next;
+  r = buddyalloc(order);
   release(&kmem.lock);
-
-  if (r) memset((char *)r, 5, PGSIZE);  // fill with junk
+  if (r == 0) {
+    // the pages may be sitting in CPU caches or the page cache.
+    kdrain();
+    textshrink();
+    acquire(&kmem.lock);
+    r = buddyalloc(order);
+    release(&kmem.lock);
+    if (r == 0) return 0;
+  }
+#ifdef KALLOC_DEBUG
+  memset((char *)r, 5, (uint64)PGSIZE << order);  // fill with junk
+#endif
+  PGREF(r) = 1;
   return (void *)r;
 }
+
+// Free pages allocated by kalloc_pages(order).
+void kfree_pages(void *pa, int order) {
+  if (order == 0) {
+    kfree(pa);
+    return;
+  }
+  if (order < 0 || order > KMAXORDER || PGINDEX(pa) % (1L << order) != 0 || (char *)pa < end ||
+      (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+  if (__sync_sub_and_fetch(&PGREF(pa), 1) != 0) panic("kfree_pages: shared");
+
+#ifdef KALLOC_DEBUG
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+
+  acquire(&kmem.lock);
+  buddyfree(pa, order);
+  release(&kmem.lock);
+}
+
+// Report how free memory is held, to watch fragmentation.
+void kmem_stat(struct memstat *st) {
+  acquire(&kmem.lock);
+  for (int k = 0; k < NORDER; k++) st->nblock[k] = kmem.nfree[k];
+  st->nuntouched = ((char *)PHYSTOP - kmem.brk) / PGSIZE;
+  release(&kmem.lock);
+  st->ncached = 0;
+  for (int id = 0; id < NCPU; id++) st->ncached += __atomic_load_n(&kcpu[id].nfree, __ATOMIC_RELAXED);
+  st->nzeroed = __atomic_load_n(&kzero.nfree, __ATOMIC_RELAXED);
+}
@@ -3,16 +3,18 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "logstat.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
 // calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
+// no FS system calls active in the transaction. Thus there is
+// never any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
@@ -21,6 +23,21 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// A commit first copies the transaction's blocks out of the
+// buffer cache into the log's private buffers.  From then on
+// it works only from those copies, so new FS system calls may
+// begin (and fill the next transaction) while the commit
+// writes the log and installs the blocks.  Only one
+// transaction can be in the on-disk log at a time, so the
+// next one waits for the current commit to finish.
+//
+// Group commit: with LOGDELAY > 0 a transaction that has gone
+// quiet is held open for up to LOGDELAY ticks, or until it fills
+// half the log, so that later system calls join it and many are
+// committed with one set of log writes.  A kernel process,
+// logflush, commits a held transaction once its time is up,
+// since no further system call may come along to do it.
+//
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
@@ -28,62 +45,92 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The number of log blocks comes from the superblock.
+// Log appends are synchronous.  Log and install writes are
+// sorted by block number and each run of consecutive blocks
+// goes to the disk as one request.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
-  int outstanding;  // how many FS sys calls are executing.
-  int committing;   // in commit(), please wait.
+  int size;          // number of data blocks in the log
+  int outstanding;   // how many FS sys calls are executing.
+  int committing;    // in commit(), please wait.
+  int snapshotting;  // commit() is copying blocks out of the cache.
+  uint opened;       // ticks when the open transaction logged its first block.
   int dev;
-  struct logheader lh;
+  struct logheader lh;   // the open transaction
+  struct logheader clh;  // the transaction being committed
+  struct buf *buf[LOGMAX];  // private copies of clh's blocks
+  struct logstat stat;
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logflush(void);
 
 void initlog(int dev, struct superblock *sb) {
-  if (sizeof(struct logheader) >= BSIZE) panic("initlog: too big logheader");
+  struct buf *b;
+
+  if (sizeof(struct logheader) > BSIZE) panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog - 1;
+  if (log.size > LOGMAX) log.size = LOGMAX;
+  if (log.size < MAXOPBLOCKS) panic("initlog: log too small");
   log.dev = dev;
+
+  // private buffers, outside the buffer cache, that hold the
+  // committing transaction's blocks.
+  for (int i = 0; i < log.size; i++) {
+    b = bnew();
+    b->dev = dev;
+    log.buf[i] = b;
+  }
+
   recover_from_log();
+
+  if (LOGDELAY > 0 && kthread("logflush", logflush) < 0) panic("initlog: logflush");
 }
 
-// Copy committed blocks from log to their home location
-static void install_trans(void) {
-  int tail;
+// Copy committed blocks from log to their home location.
+// Returns the number of disk requests used.
+static int install_trans(int recovering) {
+  int tail, nrun;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start + tail + 1);  // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]);    // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);                   // copy block to dst
-    bwrite(dbuf);                                             // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  if (recovering) {
+    for (tail = 0; tail < log.clh.n; tail++) log.buf[tail]->blockno = log.start + tail + 1;
+    brwv(log.buf, log.clh.n, 0);  // read log blocks
+  }
+  for (tail = 0; tail < log.clh.n; tail++) log.buf[tail]->blockno = log.clh.block[tail];
+  nrun = brwv(log.buf, log.clh.n, 1);  // write them to their home locations
+  if (!recovering) {
+    for (tail = 0; tail < log.clh.n; tail++) {
+      struct buf *dbuf = bread(log.dev, log.clh.block[tail]);
+      bunpin(dbuf);
+      brelse(dbuf);
+    }
   }
+  return nrun;
 }
 
 // Read the log header from disk into the in-memory log header
-static void read_head(void) {
+static void read_head(struct logheader *h) {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *)(buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  h->n = lh->n;
+  for (i = 0; i < h->n; i++) {
+    h->block[i] = lh->block[i];
   }
   brelse(buf);
 }
@@ -91,34 +138,45 @@ static void read_head(void) {
 // Write in-memory log header to disk.
 // This is the true point at which the
 // current transaction commits.
-static void write_head(void) {
+static void write_head(struct logheader *h) {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *)(buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = h->n;
+  for (i = 0; i < h->n; i++) {
+    hb->block[i] = h->block[i];
   }
   bwrite(buf);
   brelse(buf);
 }
 
 static void recover_from_log(void) {
-  read_head();
-  install_trans();  // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head();  // clear the log
+  read_head(&log.clh);
+  install_trans(1);  // if committed, copy from log to disk
+  log.clh.n = 0;
+  write_head(&log.clh);  // clear the log
+}
+
+// Should the open transaction be committed now?
+// Caller holds log.lock and has checked that no
+// FS system call is executing in it.
+static int commit_due(void) {
+  if (log.lh.n == 0) return 0;
+  return LOGDELAY == 0 || log.lh.n >= log.size / 2 || ticks - log.opened >= LOGDELAY;
 }
 
 // called at the start of each FS system call.
 void begin_op(void) {
   acquire(&log.lock);
   while (1) {
-    if (log.committing) {
+    if (log.snapshotting) {
       sleep(&log, &log.lock);
-    } else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > LOGSIZE) {
+    } else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > log.size) {
       // this op might exhaust log space; wait for commit.
-      sleep(&log, &log.lock);
+      if (log.outstanding == 0)
+        commit();  // held open by group commit; nobody else will.
+      else
+        sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
       release(&log.lock);
@@ -128,16 +186,13 @@ void begin_op(void) {
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless group commit holds the transaction open.
 void end_op(void) {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if (log.committing) panic("log.committing");
-  if (log.outstanding == 0) {
-    do_commit = 1;
-    log.committing = 1;
+  if (log.outstanding == 0 && commit_due()) {
+    commit();
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -145,40 +200,93 @@ void end_op(void) {
     wakeup(&log);
   }
   release(&log.lock);
+}
+
+// The logflush kernel process: every LOGDELAY ticks, commit
+// a transaction that group commit has held open long enough.
+static void logflush(void) {
+  uint t0;
+
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  for (;;) {
+    acquire(&tickslock);
+    t0 = ticks;
+    while (ticks - t0 < LOGDELAY) sleep(&ticks, &tickslock);
+    release(&tickslock);
 
-  if (do_commit) {
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    if (log.outstanding == 0 && !log.committing && commit_due()) commit();
     release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
-static void write_log(void) {
+// Copy the committing transaction's blocks from
+// the cache into the log's private buffers.
+static void snapshot(void) {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start + tail + 1);  // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]);  // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *from = bread(log.dev, log.clh.block[tail]);  // cache block
+    memmove(log.buf[tail]->data, from->data, BSIZE);
     brelse(from);
-    brelse(to);
   }
 }
 
+// Write the private copies to the log.
+static void write_log(void) {
+  int tail;
+
+  for (tail = 0; tail < log.clh.n; tail++) log.buf[tail]->blockno = log.start + tail + 1;
+  brwv(log.buf, log.clh.n, 1);  // write the log
+}
+
+// Commit the open transaction.
+// Caller holds log.lock, which commit() releases
+// while it does the disk writes.
 static void commit() {
-  if (log.lh.n > 0) {
-    write_log();      // Write modified blocks from cache to log
-    write_head();     // Write header to disk -- the real commit
-    install_trans();  // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();  // Erase the transaction from the log
+  uint start, nrun, n;
+
+  // wait for the previous transaction to leave the log.
+  while (log.committing) sleep(&log, &log.lock);
+  if (log.outstanding > 0 || log.lh.n == 0) {
+    // someone joined the transaction while we
+    // waited, or committed it; they'll take care of it.
+    return;
   }
+
+  log.committing = 1;
+  log.snapshotting = 1;
+  log.clh = log.lh;
+  log.lh.n = 0;
+  start = ticks;
+  release(&log.lock);
+
+  snapshot();
+
+  // the next transaction may start now.
+  acquire(&log.lock);
+  log.snapshotting = 0;
+  wakeup(&log);
+  release(&log.lock);
+
+  write_log();               // Write modified blocks from private copies to log
+  write_head(&log.clh);      // Write header to disk -- the real commit
+  nrun = install_trans(0);   // Now install writes to home locations
+  n = log.clh.n;
+  log.clh.n = 0;
+  write_head(&log.clh);      // Erase the transaction from the log
+
+  acquire(&log.lock);
+  log.stat.ncommit++;
+  log.stat.nblock += n;
+  if (n > log.stat.maxblock) log.stat.maxblock = n;
+  log.stat.nrun += nrun;
+  log.stat.ticks += ticks - start;
+  if (ticks - start > log.stat.maxticks) log.stat.maxticks = ticks - start;
+  log.committing = 0;
+  wakeup(&log);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -193,10 +301,11 @@ static void commit() {
 void log_write(struct buf *b) {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1) panic("too big a transaction");
+  acquire(&log.lock);
+  if (log.lh.n >= log.size) panic("too big a transaction");
   if (log.outstanding < 1) panic("log_write outside of trans");
 
-  acquire(&log.lock);
+  log.stat.nwrite++;
   for (i = 0; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)  // log absorbtion
       break;
@@ -204,7 +313,17 @@ void log_write(struct buf *b) {
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    if (log.lh.n == 0) log.opened = ticks;
     log.lh.n++;
+  } else {
+    log.stat.nabsorb++;
   }
   release(&log.lock);
 }
+
+// Copy the log's statistics into *st.
+void log_stat(struct logstat *st) {
+  acquire(&log.lock);
+  *st = log.stat;
+  release(&log.lock);
+}
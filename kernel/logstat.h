@@ -0,0 +1,10 @@
+struct logstat {
+  uint64 ncommit;   // transactions committed
+  uint64 nwrite;    // log_write() calls
+  uint64 nabsorb;   // log_write() calls for a block already in the transaction
+  uint64 nblock;    // blocks committed
+  uint64 maxblock;  // most blocks in one transaction
+  uint64 nrun;      // disk requests used to install committed blocks
+  uint64 ticks;     // ticks spent committing
+  uint64 maxticks;  // longest commit, in ticks
+};
@@ -15,6 +15,7 @@ void main() {
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();             // physical page allocator
+    slabinit();          // small object allocator
     kvminit();           // create kernel page table
     kvminithart();       // turn on paging
     procinit();          // process table
@@ -24,7 +25,9 @@ void main() {
     plicinithart();      // ask PLIC for device interrupts
     binit();             // buffer cache
     iinit();             // inode cache
+    textinit();          // shared program page cache
     fileinit();          // file table
+    pipeinit();          // pipe cache
     virtio_disk_init();  // emulated hard disk
     userinit();          // first user process
     __sync_synchronize();
@@ -0,0 +1,8 @@
+#define NORDER 11  // free block sizes are 2^0 .. 2^(NORDER-1) pages
+
+struct memstat {
+  uint64 nblock[NORDER];  // free blocks of 2^k pages in the buddy allocator
+  uint64 ncached;         // free pages in per-CPU caches
+  uint64 nzeroed;         // free pages in the pre-zeroed pool
+  uint64 nuntouched;      // pages never allocated since boot
+};
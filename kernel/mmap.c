@@ -0,0 +1,202 @@
+// File mappings made with mmap().
+//
+// Each mapping is a vma with MAP_SHARED or MAP_PRIVATE in
+// its flags, placed top-down from p->mmapbase, which starts
+// just below the trapframe; the heap can't grow past it.
+// Nothing is read at mmap() time: mmapfault() reads a page
+// in the first time it is used.  Pages that hold nothing but
+// file data come from the shared program page cache in exec.c,
+// so a page read by one process is mapped, not copied, into the
+// next, unless the page is going to be written to the file.
+//
+// A page of a MAP_SHARED writable mapping is mapped read-only
+// until the first store, which makes it writable; so writable
+// pages are the dirty ones, and munmap() and exit() write them
+// back to the file through the log.  Pages past the file's
+// size when it was mapped are zero and never written back.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+
+// Return p's mapping that contains va, or 0.
+static struct vma *mmaplookup(struct proc *p, uint64 va) {
+  for (struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if (v->ip && v->flags && va >= v->start && va < v->end) return v;
+  return 0;
+}
+
+// Lower p->mmapbase to the lowest mapping, or
+// raise it back to TRAPFRAME if there are none.
+static void mmapsetbase(struct proc *p) {
+  p->mmapbase = TRAPFRAME;
+  for (struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if (v->ip && v->flags && v->start < p->mmapbase) p->mmapbase = v->start;
+}
+
+// Map len bytes of f, starting at file offset off, into the
+// current process.  Returns the address, or -1.
+uint64 mmap(struct file *f, uint64 len, int prot, int flags, uint off) {
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 start;
+  uint size;
+
+  if (f->type != FD_INODE || len == 0 || off % PGSIZE != 0) return -1;
+  if (flags != MAP_SHARED && flags != MAP_PRIVATE) return -1;
+  // risc-v has no write-only pages, and a mapping
+  // of any kind shows the file's data.
+  if ((prot & PROT_WRITE) && !(prot & PROT_READ)) return -1;
+  if (prot && !f->readable) return -1;
+  if ((prot & PROT_WRITE) && flags == MAP_SHARED && !f->writable) return -1;
+
+  for (v = p->vma; v < &p->vma[NVMA] && v->ip; v++)
+    ;
+  if (v == &p->vma[NVMA]) return -1;
+  len = PGROUNDUP(len);
+  if (len > p->mmapbase || (start = p->mmapbase - len) < PGROUNDUP(p->sz)) return -1;
+
+  ilock(f->ip);
+  size = f->ip->size;
+  iunlock(f->ip);
+
+  v->start = start;
+  v->end = start + len;
+  v->ip = idup(f->ip);
+  v->off = off;
+  v->filesz = size <= off ? 0 : (size - off < len ? size - off : len);
+  v->prot = prot;
+  v->flags = flags;
+  p->mmapbase = start;
+  return start;
+}
+
+// Handle a page fault at va, which is above the heap.
+// returns 0 if the access can be retried, -1 if not.
+int mmapfault(struct proc *p, uint64 va, int write) {
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  int perm, shared;
+
+  if ((v = mmaplookup(p, va)) == 0) return -1;
+  if (write ? !(v->prot & PROT_WRITE) : !(v->prot & (PROT_READ | PROT_EXEC))) return -1;
+  shared = (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE);
+
+  if ((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V)) {
+    if (!write) return -1;
+    if (!shared) return uvmcow(p->pagetable, va);
+    // first store: the page is now dirty.
+    *pte |= PTE_W;
+    tlbflush(p->pagetable, va, 1);
+    return 0;
+  }
+
+  perm = PTE_U;
+  if (v->prot & (PROT_READ | PROT_WRITE)) perm |= PTE_R;
+  if (v->prot & PROT_EXEC) perm |= PTE_X;
+
+  // a page that won't be written back can come
+  // from the cache, copy-on-write if need be.
+  if (!shared && !write && (mem = textpage(p, va)) != 0) {
+    if (v->prot & PROT_WRITE) perm |= PTE_COW;
+    if (mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0) {
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+
+  if ((v->prot & PROT_WRITE) && (write || !shared)) perm |= PTE_W;
+  if ((mem = kalloc_zeroed()) == 0) return -1;
+  if (vmaload(p, va, mem) < 0 || mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0) {
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Write back and unmap [va, va+len) of mapping v in p.
+// The range must be page-aligned and lie within v.
+// If it is all of v, v is freed.
+static void mmapdrop(struct proc *p, struct vma *v, uint64 va, uint64 len) {
+  pte_t *pte;
+  uint64 a, n;
+
+  if ((v->flags & MAP_SHARED) && (v->prot & PROT_WRITE)) {
+    for (a = va; a < va + len && a < v->start + v->filesz; a += PGSIZE) {
+      if ((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_W) == 0) continue;
+      n = v->start + v->filesz - a;
+      if (n > PGSIZE) n = PGSIZE;
+      begin_op();
+      ilock(v->ip);
+      writei(v->ip, 0, PTE2PA(*pte), v->off + (a - v->start), n);
+      iunlock(v->ip);
+      end_op();
+    }
+  }
+  uvmunmap(p->pagetable, va, len / PGSIZE, 1);
+
+  if (va == v->start && len == v->end - v->start) {
+    begin_op();
+    iput(v->ip);
+    end_op();
+    v->ip = 0;
+  } else if (va == v->start) {
+    v->start += len;
+    v->off += len;
+    v->filesz = v->filesz > len ? v->filesz - len : 0;
+  } else {
+    v->end = va;
+    if (v->filesz > va - v->start) v->filesz = va - v->start;
+  }
+  mmapsetbase(p);
+}
+
+// Unmap [va, va+len) from the current process, which must
+// be the start or end of one mapping, or all of it.
+int munmap(uint64 va, uint64 len) {
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if (va % PGSIZE != 0 || len == 0) return -1;
+  len = PGROUNDUP(len);
+  if ((v = mmaplookup(p, va)) == 0 || va + len > v->end) return -1;
+  if (va != v->start && va + len != v->end) return -1;
+  mmapdrop(p, v, va, len);
+  return 0;
+}
+
+// Give a child of fork() the parent's mappings.
+// Private pages become copy-on-write; shared ones
+// stay shared.  Returns 0, or -1 with nothing mapped.
+// The caller copies the vmas themselves.
+int mmapfork(struct proc *p, struct proc *np) {
+  struct vma *v, *w;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->ip == 0 || v->flags == 0) continue;
+    if (uvmcopy(p->pagetable, np->pagetable, v->start, v->end, v->flags & MAP_SHARED) < 0) {
+      for (w = p->vma; w < v; w++)
+        if (w->ip && w->flags) uvmunmap(np->pagetable, w->start, (w->end - w->start) / PGSIZE, 1);
+      return -1;
+    }
+  }
+  np->mmapbase = p->mmapbase;
+  return 0;
+}
+
+// Write back and remove all of p's mappings,
+// for exit() and exec().
+void mmapexit(struct proc *p) {
+  for (struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if (v->ip && v->flags) mmapdrop(p, v, v->start, v->end - v->start);
+}
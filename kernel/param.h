@@ -7,7 +7,18 @@
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      (MAXOPBLOCKS*6)  // default blocks in on-disk log, incl. header
+#ifndef LOGDELAY
+#define LOGDELAY     0     // ticks group commit may hold a transaction open
+#endif
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define BCACHEFRAC   64    // disk block cache gets 1/BCACHEFRAC of RAM
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define READAHEAD    16    // maximum readahead window, in blocks
+#define NVMA         16    // program segments and mmap()s per process
+#define NTEXT       256    // pages in the shared program page cache
+#define NZEROPAGE   64     // pre-zeroed pages idle CPUs keep ready
+#define PIPEORDER   0      // pipe buffers are 2^PIPEORDER pages
+#define PIPEMAXORDER 8     // F_SETPIPE_SZ allows up to 2^PIPEMAXORDER pages
+#define PIPEMAXPAGES 1024  // pages all pipes together may hold beyond their default
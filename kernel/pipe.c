@@ -7,25 +7,88 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "stat.h"
+#include "memstat.h"
 
-#define PIPESIZE 512
+// The pipe's data is a ring buffer of 2^order whole pages
+// from kalloc_pages().  Readers and writers copy the largest
+// contiguous piece of the ring they can at a time, and only
+// wake the other side when it is asleep.
+//
+// splice() copies between the ring and the buffer cache without
+// holding pi->lock, which it can't across disk reads: it claims a
+// piece of the ring with pipewclaim() or piperclaim(), and other
+// writers or readers wait until it is done with that piece.
+//
+// Pages that F_SETPIPE_SZ adds to pipes beyond PIPEORDER's are
+// charged to a system-wide budget, so pipes can't pin all of
+// memory: at most PIPEMAXPAGES, and at most half of what is free.
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // ring buffer
+  uint size;      // bytes in data, a power of two
+  int order;      // data is 2^order pages
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int nrwait;     // readers asleep on nread
+  int nwwait;     // writers asleep on nwrite
+  int wbusy;      // a splice is filling the ring after nwrite
+  int rbusy;      // a splice is draining the ring at nread
 };
 
+static struct kmem_cache *pipecache;
+
+struct {
+  struct spinlock lock;
+  int npage;  // pages held by pipes beyond their default
+} pipebudget;
+
+void pipeinit(void) {
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe));
+  initlock(&pipebudget.lock, "pipebudget");
+}
+
+// Charge n more pages (or give back -n) to the pipe budget.
+// Returns 0, or -1 if the budget or free memory won't allow it.
+static int pipecharge(int n) {
+  struct memstat st;
+  uint64 nfree;
+
+  if (n > 0) {
+    kmem_stat(&st);
+    nfree = st.ncached + st.nzeroed + st.nuntouched;
+    for (int k = 0; k < NORDER; k++) nfree += st.nblock[k] << k;
+    if (n > nfree) return -1;
+  }
+  acquire(&pipebudget.lock);
+  if (n > 0 && pipebudget.npage + n > PIPEMAXPAGES) {
+    release(&pipebudget.lock);
+    return -1;
+  }
+  pipebudget.npage += n;
+  release(&pipebudget.lock);
+  return 0;
+}
+
 int pipealloc(struct file **f0, struct file **f1) {
   struct pipe *pi;
 
   pi = 0;
   *f0 = *f1 = 0;
   if ((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0) goto bad;
-  if ((pi = (struct pipe *)kalloc()) == 0) goto bad;
+  if ((pi = kmem_cache_alloc(pipecache)) == 0) goto bad;
+  if ((pi->data = kalloc_pages(PIPEORDER)) == 0) {
+    kmem_cache_free(pipecache, pi);
+    pi = 0;
+    goto bad;
+  }
+  pi->order = PIPEORDER;
+  pi->size = PGSIZE << PIPEORDER;
+  pi->nrwait = pi->nwwait = 0;
+  pi->wbusy = pi->rbusy = 0;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
@@ -42,7 +105,10 @@ int pipealloc(struct file **f0, struct file **f1) {
   return 0;
 
 bad:
-  if (pi) kfree((char *)pi);
+  if (pi) {
+    kfree_pages(pi->data, pi->order);
+    kmem_cache_free(pipecache, pi);
+  }
   if (*f0) fileclose(*f0);
   if (*f1) fileclose(*f1);
   return -1;
@@ -59,53 +125,231 @@ void pipeclose(struct pipe *pi, int writable) {
   }
   if (pi->readopen == 0 && pi->writeopen == 0) {
     release(&pi->lock);
-    kfree((char *)pi);
+    pipecharge((1 << PIPEORDER) - (1 << pi->order));
+    kfree_pages(pi->data, pi->order);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
 int pipewrite(struct pipe *pi, uint64 addr, int n) {
-  int i;
-  char ch;
+  int i, m;
+  uint off;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
-  for (i = 0; i < n; i++) {
-    while (pi->nwrite == pi->nread + PIPESIZE) {  // DOC: pipewrite-full
+  for (i = 0; i < n; i += m) {
+    while (pi->wbusy || pi->nwrite == pi->nread + pi->size) {  // DOC: pipewrite-full
       if (pi->readopen == 0 || pr->killed) {
         release(&pi->lock);
         return -1;
       }
-      wakeup(&pi->nread);
+      if (pi->nrwait) wakeup(&pi->nread);
+      pi->nwwait++;
       sleep(&pi->nwrite, &pi->lock);
+      pi->nwwait--;
     }
-    if (copyin(pr->pagetable, &ch, addr + i, 1) == -1) break;
-    pi->data[pi->nwrite++ % PIPESIZE] = ch;
+    // as much as fits before the end of the ring.
+    off = pi->nwrite % pi->size;
+    m = pi->size - (pi->nwrite - pi->nread);
+    if (m > pi->size - off) m = pi->size - off;
+    if (m > n - i) m = n - i;
+    if (copyin(pr->pagetable, pi->data + off, addr + i, m) == -1) break;
+    pi->nwrite += m;
   }
-  wakeup(&pi->nread);
+  if (pi->nrwait) wakeup(&pi->nread);
   release(&pi->lock);
   return i;
 }
 
 int piperead(struct pipe *pi, uint64 addr, int n) {
-  int i;
+  int i, m;
+  uint off;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while (pi->nread == pi->nwrite && pi->writeopen) {  // DOC: pipe-empty
+  while (pi->rbusy || (pi->nread == pi->nwrite && pi->writeopen)) {  // DOC: pipe-empty
     if (pr->killed) {
       release(&pi->lock);
       return -1;
     }
+    pi->nrwait++;
     sleep(&pi->nread, &pi->lock);  // DOC: piperead-sleep
+    pi->nrwait--;
   }
-  for (i = 0; i < n; i++) {  // DOC: piperead-copy
-    if (pi->nread == pi->nwrite) break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if (copyout(pr->pagetable, addr + i, &ch, 1) == -1) break;
+  for (i = 0; i < n && pi->nread != pi->nwrite; i += m) {  // DOC: piperead-copy
+    // as much as is there before the end of the ring.
+    off = pi->nread % pi->size;
+    m = pi->nwrite - pi->nread;
+    if (m > pi->size - off) m = pi->size - off;
+    if (m > n - i) m = n - i;
+    if (copyout(pr->pagetable, addr + i, pi->data + off, m) == -1) break;
+    pi->nread += m;
   }
-  wakeup(&pi->nwrite);  // DOC: piperead-wakeup
+  if (pi->nwwait) wakeup(&pi->nwrite);  // DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
+
+// Claim the free piece of the ring after nwrite, up to n bytes
+// and the end of the ring, for a splice to fill.  Waits for room
+// and for other writers.  Sets *dst to the piece and returns its
+// length, or -1 if the read end is closed or the process killed.
+// The caller must then call pipewdone().
+int pipewclaim(struct pipe *pi, int n, char **dst) {
+  struct proc *pr = myproc();
+  uint off;
+  int m;
+
+  acquire(&pi->lock);
+  while (pi->wbusy || pi->nwrite == pi->nread + pi->size) {
+    if (pi->readopen == 0 || pr->killed) {
+      release(&pi->lock);
+      return -1;
+    }
+    if (pi->nrwait) wakeup(&pi->nread);
+    pi->nwwait++;
+    sleep(&pi->nwrite, &pi->lock);
+    pi->nwwait--;
+  }
+  if (pi->readopen == 0) {
+    release(&pi->lock);
+    return -1;
+  }
+  off = pi->nwrite % pi->size;
+  m = pi->size - (pi->nwrite - pi->nread);
+  if (m > pi->size - off) m = pi->size - off;
+  if (m > n) m = n;
+  pi->wbusy = 1;
+  *dst = pi->data + off;
+  release(&pi->lock);
+  return m;
+}
+
+// A splice has put m bytes into the piece pipewclaim() gave it.
+void pipewdone(struct pipe *pi, int m) {
+  acquire(&pi->lock);
+  pi->nwrite += m;
+  pi->wbusy = 0;
+  if (pi->nrwait) wakeup(&pi->nread);
+  if (pi->nwwait) wakeup(&pi->nwrite);
+  release(&pi->lock);
+}
+
+// Claim the buffered piece of the ring at nread, up to n bytes
+// and the end of the ring, for a splice to drain.  If wait is
+// set, waits for data; always waits for other readers.  Sets
+// *src to the piece and returns its length, 0 at end of file or
+// if the pipe is empty and wait is clear, or -1 if the process
+// is killed.  If it returns more than 0, the caller must then
+// call piperdone().
+int piperclaim(struct pipe *pi, int n, char **src, int wait) {
+  struct proc *pr = myproc();
+  uint off;
+  int m;
+
+  acquire(&pi->lock);
+  while (pi->rbusy || (wait && pi->nread == pi->nwrite && pi->writeopen)) {
+    if (pr->killed) {
+      release(&pi->lock);
+      return -1;
+    }
+    pi->nrwait++;
+    sleep(&pi->nread, &pi->lock);
+    pi->nrwait--;
+  }
+  off = pi->nread % pi->size;
+  m = pi->nwrite - pi->nread;
+  if (m > pi->size - off) m = pi->size - off;
+  if (m > n) m = n;
+  if (m > 0) {
+    pi->rbusy = 1;
+    *src = pi->data + off;
+  }
+  release(&pi->lock);
+  return m;
+}
+
+// A splice has taken m bytes from the piece piperclaim() gave it.
+void piperdone(struct pipe *pi, int m) {
+  acquire(&pi->lock);
+  pi->nread += m;
+  pi->rbusy = 0;
+  if (pi->nwwait) wakeup(&pi->nwrite);
+  if (pi->nrwait) wakeup(&pi->nread);
+  release(&pi->lock);
+}
+
+// Return the capacity of pi's buffer in bytes.
+int pipesize(struct pipe *pi) {
+  int n;
+
+  acquire(&pi->lock);
+  n = pi->size;
+  release(&pi->lock);
+  return n;
+}
+
+// Give pi a buffer of at least n bytes, rounded up to a power
+// of two pages.  Fails if that can't hold what is buffered now,
+// or is more than 2^PIPEMAXORDER pages, or than memory or the
+// pipe budget allows.
+// Returns the new capacity, or -1.
+int pipesetsize(struct pipe *pi, int n) {
+  char *data, *old;
+  int order, oldorder;
+  uint len, off, m;
+
+  if (n < 0) return -1;
+  for (order = 0; order <= PIPEMAXORDER && (PGSIZE << order) < n; order++)
+    ;
+  if (order > PIPEMAXORDER) return -1;
+  if ((data = kalloc_pages(order)) == 0) return -1;
+
+  acquire(&pi->lock);
+  while (pi->wbusy || pi->rbusy) {
+    if (myproc()->killed || (pi->readopen == 0 && pi->writeopen == 0)) {
+      release(&pi->lock);
+      kfree_pages(data, order);
+      return -1;
+    }
+    pi->nwwait++;
+    sleep(&pi->nwrite, &pi->lock);
+    pi->nwwait--;
+  }
+  len = pi->nwrite - pi->nread;
+  if (len > (PGSIZE << order) || pipecharge((1 << order) - (1 << pi->order)) < 0) {
+    release(&pi->lock);
+    kfree_pages(data, order);
+    return -1;
+  }
+  // move what is buffered to the start of the new ring.
+  off = pi->nread % pi->size;
+  m = pi->size - off < len ? pi->size - off : len;
+  memmove(data, pi->data + off, m);
+  memmove(data + m, pi->data, len - m);
+  old = pi->data;
+  oldorder = pi->order;
+  pi->data = data;
+  pi->order = order;
+  pi->size = PGSIZE << order;
+  pi->nread = 0;
+  pi->nwrite = len;
+  if (pi->nwwait) wakeup(&pi->nwrite);
+  release(&pi->lock);
+
+  kfree_pages(old, oldorder);
+  return PGSIZE << order;
+}
+
+// Describe pi for fstat().
+void pipestat(struct pipe *pi, struct stat *st) {
+  acquire(&pi->lock);
+  st->dev = 0;
+  st->ino = 0;
+  st->type = T_PIPE;
+  st->nlink = 0;
+  st->size = pi->nwrite - pi->nread;
+  st->cap = pi->size;
+  release(&pi->lock);
+}
@@ -15,9 +15,46 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// per-CPU FIFO queues of RUNNABLE processes, linked through p->rqnext.
+// a process is on a queue exactly when it is RUNNABLE and no
+// scheduler has taken it yet.  lock order: p->lock, then runq lock.
+struct {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+} runq[NCPU];
+
+// processes sleeping on a channel, hashed by the channel's address
+// and linked through p->wqnext, so that wakeup() looks only at
+// processes that might be waiting on its channel.
+// lock order: wait queue lock, then p->lock.
+#define NWAITQ 61
+#define WAITQ(chan) (((uint64)(chan) >> 3) % NWAITQ)
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+// address space identifiers.  ASIDs are handed out in order
+// within a generation; when they run out, a new generation
+// starts, every process gets a fresh ASID when it next returns
+// to user space, and each CPU flushes its whole TLB once.
+// max is 0 if the MMU has no ASIDs.
+struct {
+  struct spinlock lock;
+  uint64 gen;
+  int next;
+  int max;
+} asids;
+
+// flush a process's whole ASID rather than more pages than this.
+#define TLBFLUSHMAX 32
+
 extern void forkret(void);
 static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
 
 extern char trampoline[];  // trampoline.S
 
@@ -26,6 +63,8 @@ void procinit(void) {
   struct proc *p;
 
   initlock(&pid_lock, "nextpid");
+  for (int i = 0; i < NCPU; i++) initlock(&runq[i].lock, "runq");
+  for (int i = 0; i < NWAITQ; i++) initlock(&waitq[i].lock, "waitq");
   for (p = proc; p < &proc[NPROC]; p++) {
     initlock(&p->lock, "proc");
 
@@ -39,6 +78,72 @@ void procinit(void) {
     p->kstack = va;
   }
   kvminithart();
+
+  // find out how many ASIDs the MMU implements.
+  initlock(&asids.lock, "asid");
+  uint64 satp = r_satp();
+  w_satp(satp | SATP_ASID(SATP_ASIDMAX));
+  asids.max = (r_satp() >> 44) & SATP_ASIDMAX;
+  w_satp(satp);
+  sfence_vma();
+  asids.gen = 1;
+  asids.next = 1;  // the kernel uses ASID 0
+}
+
+// Return the ASID p should run with on this CPU, first
+// flushing any of its stale translations from the TLB.
+// Called with interrupts off, by p, on its way to user space.
+int procasid(struct proc *p) {
+  struct cpu *c = mycpu();
+  uint bit = 1 << cpuid();
+  uint64 gen;
+
+  if (asids.max == 0) {
+    sfence_vma();
+    return 0;
+  }
+
+  gen = __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE);
+  if (p->asidgen != gen) {
+    acquire(&asids.lock);
+    if (asids.next > asids.max) {
+      __atomic_store_n(&asids.gen, asids.gen + 1, __ATOMIC_RELEASE);
+      asids.next = 1;
+    }
+    // no CPU has used this ASID since it last flushed.
+    p->asid = asids.next++;
+    p->asidgen = gen = asids.gen;
+    p->tlbstale = 0;
+    release(&asids.lock);
+  }
+
+  if (c->asidgen != gen) {
+    sfence_vma();
+    c->asidgen = gen;
+  } else if (p->tlbstale & bit) {
+    sfence_vma_asid(p->asid);
+  }
+  p->tlbstale &= ~bit;
+  return p->asid;
+}
+
+// The PTEs for npages pages at va in pagetable have changed.
+// If it is the current process's page table, flush them from
+// this CPU's TLB, and make the other CPUs flush the process's
+// ASID before they next run it.
+void tlbflush(pagetable_t pagetable, uint64 va, uint64 npages) {
+  struct proc *p = myproc();
+
+  if (p == 0 || p->pagetable != pagetable || p->asidgen == 0 || asids.max == 0) return;
+
+  push_off();
+  if (npages > TLBFLUSHMAX) {
+    sfence_vma_asid(p->asid);
+  } else {
+    for (uint64 i = 0; i < npages; i++) sfence_vma_page(va + i * PGSIZE, p->asid);
+  }
+  p->tlbstale |= ~(1 << cpuid());
+  pop_off();
 }
 
 // Must be called with interrupts disabled,
@@ -96,6 +201,8 @@ static struct proc *allocproc(void) {
 
 found:
   p->pid = allocpid();
+  p->asidgen = 0;
+  p->mmapbase = TRAPFRAME;
 
   // Allocate a trapframe page.
   if ((p->trapframe = (struct trapframe *)kalloc()) == 0) {
@@ -200,20 +307,40 @@ void userinit(void) {
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
+
+  release(&p->lock);
+}
+
+// Start a kernel process that runs fn(), which never returns
+// and never goes to user space.  fn starts out holding its
+// p->lock, from the scheduler, and must release it first, as
+// forkret() does.  Returns 0, or -1 if out of procs or memory.
+int kthread(char *name, void (*fn)(void)) {
+  struct proc *p;
 
+  if ((p = allocproc()) == 0) return -1;
+  p->context.ra = (uint64)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  setrunnable(p);
   release(&p->lock);
+  return 0;
 }
 
 // Grow or shrink user memory by n bytes.
+// New memory is allocated by uvmfault() when first used,
+// unless populate is set.
 // Return 0 on success, -1 on failure.
-int growproc(int n) {
-  uint sz;
+int growproc(int n, int populate) {
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if (n > 0) {
-    if ((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if (sz + n >= p->mmapbase) return -1;
+    if (!populate) {
+      sz += n;
+    } else if ((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
       return -1;
     }
   } else if (n < 0) {
@@ -236,12 +363,17 @@ int fork(void) {
   }
 
   // Copy user memory from parent to child.
-  if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0) {
+  if (uvmcopy(p->pagetable, np->pagetable, 0, p->sz, 0) < 0) {
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  if (mmapfork(p, np) < 0) {
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   np->parent = p;
 
@@ -255,12 +387,16 @@ int fork(void) {
   for (i = 0; i < NOFILE; i++)
     if (p->ofile[i]) np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  for (i = 0; i < NVMA; i++) {
+    np->vma[i] = p->vma[i];
+    if (np->vma[i].ip) idup(np->vma[i].ip);
+  }
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  setrunnable(np);
 
   release(&np->lock);
 
@@ -319,7 +455,9 @@ void exit(int status) {
     }
   }
 
+  mmapexit(p);
   begin_op();
+  vmafree(p->vma);
   iput(p->cwd);
   end_op();
   p->cwd = 0;
@@ -383,6 +521,10 @@ int wait(uint64 addr, int flags) {
   int havekids, pid;
   struct proc *p = myproc();
 
+  // read in the page at addr now, if it comes from a file,
+  // so copyout() won't sleep while we hold the locks below.
+  if (addr != 0 && vmatouch(p, addr, sizeof(int)) < 0) return -1;
+
   // hold p->lock for the whole time to avoid lost
   // wakeups from a child's exit().
   acquire(&p->lock);
@@ -433,45 +575,85 @@ int wait(uint64 addr, int flags) {
   }
 }
 
+// Mark p RUNNABLE and append it to this CPU's run queue.
+// Caller must hold p->lock, so interrupts are off.
+static void setrunnable(struct proc *p) {
+  if (!holding(&p->lock)) panic("setrunnable");
+  p->state = RUNNABLE;
+
+  int id = cpuid();
+  acquire(&runq[id].lock);
+  p->rqnext = 0;
+  if (runq[id].tail)
+    runq[id].tail->rqnext = p;
+  else
+    runq[id].head = p;
+  runq[id].tail = p;
+  release(&runq[id].lock);
+}
+
+// Remove and return the process at the head of run queue id, or 0.
+static struct proc *runqpop(int id) {
+  struct proc *p;
+
+  // peek without the lock so that idle CPUs
+  // don't hammer the locks of empty queues.
+  if (__atomic_load_n(&runq[id].head, __ATOMIC_RELAXED) == 0) return 0;
+
+  acquire(&runq[id].lock);
+  p = runq[id].head;
+  if (p) {
+    runq[id].head = p->rqnext;
+    if (runq[id].head == 0) runq[id].tail = 0;
+    p->rqnext = 0;
+  }
+  release(&runq[id].lock);
+  return p;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process from this CPU's run queue,
+//    or steal one from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
 void scheduler(void) {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
 
   c->proc = 0;
   for (;;) {
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    int found = 0;
-    for (p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if (p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if (found == 0) {
-      intr_on();
-      asm volatile("wfi");
+    p = runqpop(id);
+    for (int i = 1; p == 0 && i < NCPU; i++) p = runqpop((id + i) % NCPU);
+    if (p == 0) {
+      // nothing to run: zero a page for kalloc_zeroed(),
+      // or if there is no need, wait for an interrupt.
+      if (!kzerofill()) asm volatile("wfi");
+      continue;
     }
+
+    // p is off the queue, so nobody else will run it;
+    // and a RUNNABLE process can't be freed.
+    acquire(&p->lock);
+    if (p->state != RUNNABLE) panic("scheduler runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -500,7 +682,7 @@ void sched(void) {
 void yield(void) {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -524,50 +706,88 @@ void forkret(void) {
   usertrapret();
 }
 
+// Take p off wait queue wq.
+// Caller must hold wq->lock.
+static void wqremove(struct waitq *wq, struct proc *p) {
+  struct proc **pp;
+
+  for (pp = &wq->head; *pp != p; pp = &(*pp)->wqnext)
+    if (*pp == 0) panic("wqremove");
+  *pp = p->wqnext;
+  p->wqnext = 0;
+  p->wqueued = 0;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void sleep(void *chan, struct spinlock *lk) {
   struct proc *p = myproc();
+  struct waitq *wq = &waitq[WAITQ(chan)];
+
+  if (lk == &p->lock) {
+    // wait() sleeps holding p->lock, which can't be held while
+    // acquiring a wait queue lock.  it stays off the wait queues;
+    // only exit()'s wakeup1() and kill() wake it, and they
+    // find it through the proc table.
+    p->chan = chan;
+    p->state = SLEEPING;
+    sched();
+    p->chan = 0;
+    return;
+  }
 
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the wait queue lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
-  if (lk != &p->lock) {  // DOC: sleeplock0
-    acquire(&p->lock);   // DOC: sleeplock1
-    release(lk);
-  }
+  // (wakeup locks it), so it's okay to release lk.
+  acquire(&wq->lock);  // DOC: sleeplock0
+  acquire(&p->lock);   // DOC: sleeplock1
+  release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = wq->head;
+  wq->head = p;
+  p->wqueued = 1;
+  release(&wq->lock);
 
   sched();
 
-  // Tidy up.
+  // Tidy up.  kill() wakes a sleeper without
+  // taking it off the wait queue.
   p->chan = 0;
+  release(&p->lock);
+  acquire(&wq->lock);
+  if (p->wqueued) wqremove(wq, p);
+  release(&wq->lock);
 
   // Reacquire original lock.
-  if (lk != &p->lock) {
-    release(&p->lock);
-    acquire(lk);
-  }
+  acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void wakeup(void *chan) {
-  struct proc *p;
+  struct waitq *wq = &waitq[WAITQ(chan)];
+  struct proc **pp, *p;
 
-  for (p = proc; p < &proc[NPROC]; p++) {
+  acquire(&wq->lock);
+  for (pp = &wq->head; (p = *pp) != 0;) {
     acquire(&p->lock);
-    if (p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+    if (p->state != SLEEPING || p->chan == chan) {
+      // wake it, or drop the entry kill() left behind.
+      *pp = p->wqnext;
+      p->wqnext = 0;
+      p->wqueued = 0;
+      if (p->state == SLEEPING) setrunnable(p);
+    } else {
+      pp = &p->wqnext;
     }
     release(&p->lock);
   }
+  release(&wq->lock);
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -575,7 +795,7 @@ void wakeup(void *chan) {
 static void wakeup1(struct proc *p) {
   if (!holding(&p->lock)) panic("wakeup1");
   if (p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    setrunnable(p);
   }
 }
 
@@ -591,7 +811,7 @@ int kill(int pid) {
       p->killed = 1;
       if (p->state == SLEEPING) {
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -24,6 +24,7 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this cpu's TLB was last flushed for
 };
 
 extern struct cpu cpus[NCPU];
@@ -78,10 +79,23 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 tlbflush;  // no ASIDs: trampoline.S flushes the TLB on satp switches
 };
 
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A range of user memory paged in from a file on first use,
+// such as a segment of the program exec() loaded.
+struct vma {
+  uint64 start;       // first address, page-aligned
+  uint64 end;         // end of the range
+  struct inode *ip;   // file, or 0 if this slot is unused
+  uint off;           // file offset of start
+  uint filesz;        // bytes that come from the file; the rest are zero
+  int prot;           // mmap(): PROT_ bits
+  int flags;          // mmap(): MAP_SHARED or MAP_PRIVATE; 0 for the program image
+};
+
 
 // Per-process state
 struct proc {
@@ -95,14 +109,26 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
+  // the run queue lock must be held when using this:
+  struct proc *rqnext;         // Next RUNNABLE process on the same run queue
+
+  // the wait queue lock must be held when using these:
+  struct proc *wqnext;         // Next process on the same wait queue
+  int wqueued;                 // If non-zero, on the wait queue for chan
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
+  int asid;                    // Address space identifier, valid in generation asidgen
+  uint64 asidgen;              // ASID generation, or 0 if none assigned
+  uint tlbstale;               // CPUs that must flush asid before running user code
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // File-backed memory
+  uint64 mmapbase;             // Lowest file mapping; the heap ends below it
   char name[16];               // Process name (debugging)
 };
 
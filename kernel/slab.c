@@ -0,0 +1,178 @@
+// Slab allocator for small fixed-size kernel objects.
+//
+// A cache hands out objects of one size, carved from
+// slabs: kalloc() pages that start with a struct slab
+// and hold as many objects as fit after it.  A freed
+// object's slab is found by rounding its address down to
+// the page.  Slabs with free objects sit on the cache's
+// partial list; a slab whose objects are all free again
+// goes back to kalloc(), unless it is the cache's last.
+//
+// Each CPU keeps a magazine of up to MAGSIZE free objects
+// per cache, so most allocations and frees touch only that
+// CPU's magazine, with interrupts off, and no lock.
+// Magazines refill from and spill to the slabs half a
+// magazine at a time, under the cache's lock.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE 8    // object caches in the system
+#define MAGSIZE 16  // objects in a per-CPU magazine
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;  // on the partial list
+  struct slab *prev;
+  void *free;         // free objects, linked through their first word
+  int inuse;          // objects allocated, including those in magazines
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;    // object size, rounded up to 8 bytes
+  int perslab;  // objects per slab
+  struct slab partial;  // circular list of slabs with free objects
+  int nslab;            // slabs allocated
+  struct {
+    void *obj[MAGSIZE];
+    int n;
+  } mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} slabs;
+
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+void slabinit(void) { initlock(&slabs.lock, "slabs"); }
+
+// Make a cache of objects of the given size, which
+// must leave room for at least one in a page.
+struct kmem_cache *kmem_cache_create(char *name, uint size) {
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if (size < sizeof(void *) || SLABHDR + size > PGSIZE) panic("kmem_cache_create: size");
+
+  acquire(&slabs.lock);
+  if (slabs.n == NCACHE) panic("kmem_cache_create: too many caches");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  c->partial.next = c->partial.prev = &c->partial;
+  return c;
+}
+
+// Add a new slab to c's partial list.
+// Returns 0 if out of memory.
+// Caller must hold c->lock.
+static struct slab *slabgrow(struct kmem_cache *c) {
+  struct slab *s;
+  char *obj;
+
+  if ((s = (struct slab *)kalloc()) == 0) return 0;
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  for (int i = c->perslab - 1; i >= 0; i--) {
+    obj = (char *)s + SLABHDR + i * c->size;
+    *(void **)obj = s->free;
+    s->free = obj;
+  }
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+  c->nslab++;
+  return s;
+}
+
+// Take up to n objects from c's slabs into obj[].
+// Returns the number taken.  Caller must hold c->lock.
+static int slabget(struct kmem_cache *c, void **obj, int n) {
+  struct slab *s;
+  int got = 0;
+
+  while (got < n) {
+    s = c->partial.next;
+    if (s == &c->partial && (s = slabgrow(c)) == 0) break;
+    while (got < n && s->free) {
+      obj[got++] = s->free;
+      s->free = *(void **)s->free;
+      s->inuse++;
+    }
+    if (s->free == 0) {  // full: off the partial list
+      s->prev->next = s->next;
+      s->next->prev = s->prev;
+    }
+  }
+  return got;
+}
+
+// Return n objects from obj[] to their slabs.
+// Caller must hold c->lock.
+static void slabput(struct kmem_cache *c, void **obj, int n) {
+  struct slab *s;
+
+  for (int i = 0; i < n; i++) {
+    s = (struct slab *)PGROUNDDOWN((uint64)obj[i]);
+    if (s->cache != c) panic("kmem_cache_free: wrong cache");
+    if (s->free == 0) {  // was full: back on the partial list
+      s->next = c->partial.next;
+      s->prev = &c->partial;
+      c->partial.next->prev = s;
+      c->partial.next = s;
+    }
+    *(void **)obj[i] = s->free;
+    s->free = obj[i];
+    if (--s->inuse == 0 && c->nslab > 1) {
+      s->prev->next = s->next;
+      s->next->prev = s->prev;
+      c->nslab--;
+      kfree((void *)s);
+    }
+  }
+}
+
+// Allocate an object from c.
+// Returns 0 if out of memory.
+void *kmem_cache_alloc(struct kmem_cache *c) {
+  void *obj = 0;
+
+  push_off();
+  int id = cpuid();
+  if (c->mag[id].n == 0) {
+    acquire(&c->lock);
+    c->mag[id].n = slabget(c, c->mag[id].obj, MAGSIZE / 2);
+    release(&c->lock);
+  }
+  if (c->mag[id].n > 0) obj = c->mag[id].obj[--c->mag[id].n];
+  pop_off();
+  return obj;
+}
+
+// Free an object allocated from c.
+void kmem_cache_free(struct kmem_cache *c, void *obj) {
+  push_off();
+  int id = cpuid();
+  if (c->mag[id].n == MAGSIZE) {
+    acquire(&c->lock);
+    slabput(c, c->mag[id].obj + MAGSIZE / 2, MAGSIZE / 2);
+    release(&c->lock);
+    c->mag[id].n = MAGSIZE / 2;
+  }
+  c->mag[id].obj[c->mag[id].n++] = obj;
+  pop_off();
+}
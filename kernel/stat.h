@@ -1,11 +1,13 @@
 #define T_DIR     1   // Directory
 #define T_FILE    2   // File
 #define T_DEVICE  3   // Device
+#define T_PIPE    4   // Pipe
 
 struct stat {
   int dev;     // File system's disk device
   uint ino;    // Inode number
   short type;  // Type of file
   short nlink; // Number of links to file
-  uint64 size; // Size of file in bytes
+  uint64 size; // Size of file in bytes; for a pipe, bytes buffered
+  uint64 cap;  // Pipe buffer capacity in bytes
 };
@@ -1,11 +1,37 @@
 #include "types.h"
 
+// memset, memmove and memcmp work a 64-bit word at a time, eight
+// words per loop iteration, once the pointers are aligned.  RISC-V
+// may trap on misaligned word accesses, so buffers whose addresses
+// differ modulo 8 are still handled a byte at a time.
+
+#define WSIZE sizeof(uint64)
+#define ALIGNED(p) (((uint64)(p) & (WSIZE - 1)) == 0)
+
 void *memset(void *dst, int c, uint n) {
-  char *cdst = (char *)dst;
-  int i;
-  for (i = 0; i < n; i++) {
-    cdst[i] = c;
+  uchar *d = (uchar *)dst;
+  uint64 *w, x;
+
+  for (; n > 0 && !ALIGNED(d); n--) *d++ = c;
+
+  x = (uchar)c;
+  x |= x << 8;
+  x |= x << 16;
+  x |= x << 32;
+  w = (uint64 *)d;
+  for (; n >= 8 * WSIZE; n -= 8 * WSIZE, w += 8) {
+    w[0] = x;
+    w[1] = x;
+    w[2] = x;
+    w[3] = x;
+    w[4] = x;
+    w[5] = x;
+    w[6] = x;
+    w[7] = x;
   }
+  for (; n >= WSIZE; n -= WSIZE) *w++ = x;
+
+  for (d = (uchar *)w; n > 0; n--) *d++ = c;
   return dst;
 }
 
@@ -14,6 +40,12 @@ int memcmp(const void *v1, const void *v2, uint n) {
 
   s1 = v1;
   s2 = v2;
+  if (((uint64)s1 & (WSIZE - 1)) == ((uint64)s2 & (WSIZE - 1))) {
+    for (; n > 0 && !ALIGNED(s1); n--, s1++, s2++)
+      if (*s1 != *s2) return *s1 - *s2;
+    // skip equal words; the bytes below find the difference.
+    for (; n >= WSIZE && *(uint64 *)s1 == *(uint64 *)s2; n -= WSIZE) s1 += WSIZE, s2 += WSIZE;
+  }
   while (n-- > 0) {
     if (*s1 != *s2) return *s1 - *s2;
     s1++, s2++;
@@ -22,18 +54,64 @@ int memcmp(const void *v1, const void *v2, uint n) {
   return 0;
 }
 
+// copy n bytes forward, from low addresses to high.
+static void copyup(uchar *d, const uchar *s, uint n) {
+  if (((uint64)d & (WSIZE - 1)) == ((uint64)s & (WSIZE - 1))) {
+    for (; n > 0 && !ALIGNED(d); n--) *d++ = *s++;
+    uint64 *wd = (uint64 *)d;
+    const uint64 *ws = (const uint64 *)s;
+    for (; n >= 8 * WSIZE; n -= 8 * WSIZE, wd += 8, ws += 8) {
+      wd[0] = ws[0];
+      wd[1] = ws[1];
+      wd[2] = ws[2];
+      wd[3] = ws[3];
+      wd[4] = ws[4];
+      wd[5] = ws[5];
+      wd[6] = ws[6];
+      wd[7] = ws[7];
+    }
+    for (; n >= WSIZE; n -= WSIZE) *wd++ = *ws++;
+    d = (uchar *)wd;
+    s = (const uchar *)ws;
+  }
+  while (n-- > 0) *d++ = *s++;
+}
+
+// copy n bytes backward, ending just below d and s,
+// for overlapping moves to a higher address.
+static void copydown(uchar *d, const uchar *s, uint n) {
+  if (((uint64)d & (WSIZE - 1)) == ((uint64)s & (WSIZE - 1))) {
+    for (; n > 0 && !ALIGNED(d); n--) *--d = *--s;
+    uint64 *wd = (uint64 *)d;
+    const uint64 *ws = (const uint64 *)s;
+    for (; n >= 8 * WSIZE; n -= 8 * WSIZE) {
+      wd -= 8, ws -= 8;
+      wd[7] = ws[7];
+      wd[6] = ws[6];
+      wd[5] = ws[5];
+      wd[4] = ws[4];
+      wd[3] = ws[3];
+      wd[2] = ws[2];
+      wd[1] = ws[1];
+      wd[0] = ws[0];
+    }
+    for (; n >= WSIZE; n -= WSIZE) *--wd = *--ws;
+    d = (uchar *)wd;
+    s = (const uchar *)ws;
+  }
+  while (n-- > 0) *--d = *--s;
+}
+
 void *memmove(void *dst, const void *src, uint n) {
-  const char *s;
-  char *d;
+  const uchar *s;
+  uchar *d;
 
   s = src;
   d = dst;
-  if (s < d && s + n > d) {
-    s += n;
-    d += n;
-    while (n-- > 0) *--d = *--s;
-  } else
-    while (n-- > 0) *d++ = *s++;
+  if (s < d && s + n > d)
+    copydown(d + n, s + n, n);
+  else
+    copyup(d, s, n);
 
   return dst;
 }
@@ -90,6 +90,17 @@ extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
 extern uint64 sys_rename(void);
 extern uint64 sys_yield(void);
+extern uint64 sys_logstat(void);
+extern uint64 sys_sbrkx(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_fcntl(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
 
 static uint64 (*syscalls[])(void) = {
     [SYS_fork] sys_fork,   [SYS_exit] sys_exit,     [SYS_wait] sys_wait,     [SYS_pipe] sys_pipe,
@@ -97,7 +108,10 @@ static uint64 (*syscalls[])(void) = {
     [SYS_chdir] sys_chdir, [SYS_dup] sys_dup,       [SYS_getpid] sys_getpid, [SYS_sbrk] sys_sbrk,
     [SYS_sleep] sys_sleep, [SYS_uptime] sys_uptime, [SYS_open] sys_open,     [SYS_write] sys_write,
     [SYS_mknod] sys_mknod, [SYS_unlink] sys_unlink, [SYS_link] sys_link,     [SYS_mkdir] sys_mkdir,
-    [SYS_close] sys_close, [SYS_rename] sys_rename, [SYS_yield] sys_yield,
+    [SYS_close] sys_close, [SYS_rename] sys_rename, [SYS_yield] sys_yield,   [SYS_logstat] sys_logstat,
+    [SYS_sbrkx] sys_sbrkx, [SYS_memstat] sys_memstat, [SYS_mmap] sys_mmap, [SYS_munmap] sys_munmap,
+    [SYS_fcntl] sys_fcntl, [SYS_splice] sys_splice, [SYS_readv] sys_readv,   [SYS_writev] sys_writev,
+    [SYS_pread] sys_pread, [SYS_pwrite] sys_pwrite,
 };
 
 void syscall(void) {
@@ -22,3 +22,14 @@
 #define SYS_close  21
 #define SYS_rename 22
 #define SYS_yield  23
+#define SYS_logstat 24
+#define SYS_sbrkx  25
+#define SYS_memstat 26
+#define SYS_mmap   27
+#define SYS_munmap 28
+#define SYS_fcntl  29
+#define SYS_splice 30
+#define SYS_readv  31
+#define SYS_writev 32
+#define SYS_pread  33
+#define SYS_pwrite 34
@@ -15,6 +15,8 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "logstat.h"
+#include "uio.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -73,6 +75,76 @@ uint64 sys_write(void) {
   return filewrite(f, p, n);
 }
 
+// Like read() and write(), but at the given offset
+// in the file, which keeps its own offset.
+uint64 sys_pread(void) {
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  if (argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0) return -1;
+  if (off < 0) return -1;
+  return filepread(f, p, n, off);
+}
+
+uint64 sys_pwrite(void) {
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  if (argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0) return -1;
+  if (off < 0) return -1;
+  return filepwrite(f, p, n, off);
+}
+
+// Read into or write from each of the cnt buffers described
+// by the iovec array at user address uiov, in order, as
+// one read() or write() per buffer.  Stops at a short read.
+// Returns the total, or -1 if nothing moved and one failed.
+static int filerwv(struct file *f, uint64 uiov, int cnt, int write) {
+  struct iovec iov[IOV_MAX];
+  uint64 tot = 0;
+  int i, r;
+
+  if (cnt < 0 || cnt > IOV_MAX) return -1;
+  if (copyin(myproc()->pagetable, (char *)iov, uiov, cnt * sizeof(iov[0])) < 0) return -1;
+  for (i = 0; i < cnt; i++) {
+    tot += iov[i].iov_len;
+    if (iov[i].iov_len > 0x7fffffff || tot > 0x7fffffff) return -1;
+  }
+
+  tot = 0;
+  for (i = 0; i < cnt; i++) {
+    if (iov[i].iov_len == 0) continue;
+    if (write)
+      r = filewrite(f, (uint64)iov[i].iov_base, iov[i].iov_len);
+    else
+      r = fileread(f, (uint64)iov[i].iov_base, iov[i].iov_len);
+    if (r < 0) return tot > 0 ? tot : -1;
+    tot += r;
+    if (r < iov[i].iov_len) break;
+  }
+  return tot;
+}
+
+uint64 sys_readv(void) {
+  struct file *f;
+  int cnt;
+  uint64 iov;
+
+  if (argfd(0, 0, &f) < 0 || argaddr(1, &iov) < 0 || argint(2, &cnt) < 0) return -1;
+  return filerwv(f, iov, cnt, 0);
+}
+
+uint64 sys_writev(void) {
+  struct file *f;
+  int cnt;
+  uint64 iov;
+
+  if (argfd(0, 0, &f) < 0 || argaddr(1, &iov) < 0 || argint(2, &cnt) < 0) return -1;
+  return filerwv(f, iov, cnt, 1);
+}
+
 uint64 sys_close(void) {
   int fd;
   struct file *f;
@@ -286,6 +358,9 @@ uint64 sys_open(void) {
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->ra_off = 0;
+    f->ra_next = 0;
+    f->ra_win = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -415,3 +490,61 @@ uint64 sys_pipe(void) {
   }
   return 0;
 }
+
+// Copy the file system log's statistics to user space.
+uint64 sys_logstat(void) {
+  uint64 addr;  // user pointer to struct logstat
+  struct logstat st;
+
+  if (argaddr(0, &addr) < 0) return -1;
+  log_stat(&st);
+  if (copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0) return -1;
+  return 0;
+}
+
+// Map a file into memory; the address is a hint, ignored.
+uint64 sys_mmap(void) {
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f;
+
+  if (argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 || argint(3, &flags) < 0 ||
+      argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  if (len <= 0 || off < 0) return -1;
+  return mmap(f, len, prot, flags, off);
+}
+
+uint64 sys_munmap(void) {
+  uint64 addr;
+  int len;
+
+  if (argaddr(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0) return -1;
+  return munmap(addr, len);
+}
+
+// Control an open file: F_GETPIPE_SZ and F_SETPIPE_SZ.
+uint64 sys_fcntl(void) {
+  struct file *f;
+  int cmd, arg;
+
+  if (argfd(0, 0, &f) < 0 || argint(1, &cmd) < 0 || argint(2, &arg) < 0) return -1;
+  if (f->type != FD_PIPE) return -1;
+  switch (cmd) {
+    case F_GETPIPE_SZ:
+      return pipesize(f->pipe);
+    case F_SETPIPE_SZ:
+      return pipesetsize(f->pipe, arg);
+  }
+  return -1;
+}
+
+// Move bytes between a file and a pipe, or two pipes,
+// inside the kernel.
+uint64 sys_splice(void) {
+  struct file *in, *out;
+  int n;
+
+  if (argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0) return -1;
+  return filesplice(in, out, n);
+}
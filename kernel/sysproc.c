@@ -6,6 +6,8 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "fcntl.h"
+#include "memstat.h"
 
 uint64 sys_exit(void) {
   int n;
@@ -27,15 +29,36 @@ uint64 sys_wait(void) {
 }
 
 uint64 sys_sbrk(void) {
-  int addr;
+  uint64 addr;
   int n;
 
   if (argint(0, &n) < 0) return -1;
   addr = myproc()->sz;
-  if (growproc(n) < 0) return -1;
+  if (growproc(n, 0) < 0) return -1;
   return addr;
 }
 
+// sbrk with SBRK_ flags.
+uint64 sys_sbrkx(void) {
+  uint64 addr;
+  int n, flags;
+
+  if (argint(0, &n) < 0 || argint(1, &flags) < 0) return -1;
+  addr = myproc()->sz;
+  if (growproc(n, flags & SBRK_POPULATE) < 0) return -1;
+  return addr;
+}
+
+uint64 sys_memstat(void) {
+  uint64 addr;  // user pointer to struct memstat
+  struct memstat st;
+
+  if (argaddr(0, &addr) < 0) return -1;
+  kmem_stat(&st);
+  if (copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0) return -1;
+  return 0;
+}
+
 uint64 sys_sleep(void) {
   int n;
   uint ticks0;
@@ -104,9 +127,6 @@ uint64 sys_yield(void){
         break;
     }
   }
-  acquire(&p->lock);
-  p->state = RUNNABLE;
-  sched();
-  release(&p->lock);
+  yield();
   return 0;
 }
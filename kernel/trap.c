@@ -55,6 +55,9 @@ void usertrap(void) {
     syscall();
   } else if ((which_dev = devintr()) != 0) {
     // ok
+  } else if ((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+             uvmfault(p, r_stval(), r_scause() == 15) == 0) {
+    // page fault on a page not read in yet, or a copy-on-write page.
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -103,7 +106,8 @@ void usertrapret(void) {
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->pagetable) | SATP_ASID(procasid(p));
+  p->trapframe->tlbflush = (satp & SATP_ASID(SATP_ASIDMAX)) == 0;
 
   // jump to trampoline.S at the top of memory, which
   // switches to the user page table, restores user registers,
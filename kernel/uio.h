@@ -0,0 +1,6 @@
+#define IOV_MAX 16  // max buffers in one readv() or writev()
+
+struct iovec {
+  void *iov_base;  // user buffer
+  uint64 iov_len;  // its length in bytes
+};
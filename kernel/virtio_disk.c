@@ -32,16 +32,22 @@ static struct disk {
 
   // our own book-keeping.
   char free[NUM];   // is a descriptor free?
-  uint16 used_idx;  // we've looked this far in used[2..NUM].
+  uint16 used_idx;  // we've looked this far in used->elems[].
+  int pending;      // requests added to avail since the last notify.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // status is indexed by first descriptor index of chain,
+  // b by the index of the descriptor holding b->data.
   struct {
     struct buf *b;
     char status;
   } info[NUM];
 
+  // disk command headers.
+  // one-for-one with descriptors, for convenience.
+  struct virtio_blk_req ops[NUM];
+
   struct spinlock vdisk_lock;
 
 } __attribute__((aligned(PGSIZE))) disk;
@@ -136,8 +142,8 @@ static void free_chain(int i) {
   }
 }
 
-static int alloc3_desc(int *idx) {
-  for (int i = 0; i < 3; i++) {
+static int allocn_desc(int *idx, int n) {
+  for (int i = 0; i < n; i++) {
     idx[i] = alloc_desc();
     if (idx[i] < 0) {
       for (int j = 0; j < i; j++) free_desc(idx[j]);
@@ -147,65 +153,91 @@ static int alloc3_desc(int *idx) {
   return 0;
 }
 
-void virtio_disk_rw(struct buf *b, int write) {
-  uint64 sector = b->blockno * (BSIZE / 512);
+// tell the device about requests added to the avail ring
+// since the last notification.  caller holds vdisk_lock.
+static void notify(void) {
+  if (disk.pending) {
+    __sync_synchronize();
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;  // value is queue number
+    disk.pending = 0;
+  }
+}
+
+// Queue a read or write of b without waiting for it.
+// The device isn't told about the request until
+// virtio_disk_kick(), so that a caller can queue
+// several requests and notify the device once.
+// b must stay locked until virtio_disk_wait(b) returns.
+void virtio_disk_submit(struct buf *b, int write) { virtio_disk_submitv(&b, 1, write); }
+
+// Queue a single request that reads or writes the n buffers
+// bs[0..n-1], which must hold consecutive blocks of one device.
+// Each buffer completes, for virtio_disk_wait(), when the
+// whole request does.  Runs longer than VIRTIO_MAXSEG
+// are split into several requests.
+void virtio_disk_submitv(struct buf **bs, int n, int write) {
+  if (n < 1) panic("virtio_disk_submitv");
+
+  for (; n > VIRTIO_MAXSEG; bs += VIRTIO_MAXSEG, n -= VIRTIO_MAXSEG) virtio_disk_submitv(bs, VIRTIO_MAXSEG, write);
+
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
 
   acquire(&disk.vdisk_lock);
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  // the spec says that legacy block operations use a
+  // descriptor for type/reserved/sector, then one per
+  // data buffer, then one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[VIRTIO_MAXSEG + 2];
   while (1) {
-    if (alloc3_desc(idx) == 0) {
+    if (allocn_desc(idx, n + 2) == 0) {
       break;
     }
+    // the ring is full of requests; make sure the
+    // device knows about them before waiting for one.
+    notify();
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
   // format the three descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
 
   if (write)
-    buf0.type = VIRTIO_BLK_T_OUT;  // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT;  // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN;  // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64)kvmpa((uint64)&buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
+    buf0->type = VIRTIO_BLK_T_IN;  // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  disk.desc[idx[0]].addr = (uint64)buf0;
+  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64)b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if (write)
-    disk.desc[idx[1]].flags = 0;  // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE;  // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for (int i = 1; i <= n; i++) {
+    struct buf *b = bs[i - 1];
+    disk.desc[idx[i]].addr = (uint64)b->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if (write)
+      disk.desc[idx[i]].flags = 0;  // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE;  // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i + 1];
 
-  disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64)&disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE;  // device writes the status
-  disk.desc[idx[2]].next = 0;
+    // record struct buf for virtio_disk_intr().
+    b->disk = 1;
+    disk.info[idx[i]].b = b;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.info[idx[0]].status = 0xff;  // device writes 0 on success
+  disk.desc[idx[n + 1]].addr = (uint64)&disk.info[idx[0]].status;
+  disk.desc[idx[n + 1]].len = 1;
+  disk.desc[idx[n + 1]].flags = VRING_DESC_F_WRITE;  // device writes the status
+  disk.desc[idx[n + 1]].next = 0;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
@@ -214,34 +246,70 @@ void virtio_disk_rw(struct buf *b, int write) {
   disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
   __sync_synchronize();
   disk.avail[1] = disk.avail[1] + 1;
+  disk.pending++;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;  // value is queue number
+  release(&disk.vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
+// Tell the device about all requests queued by virtio_disk_submit().
+void virtio_disk_kick(void) {
+  acquire(&disk.vdisk_lock);
+  notify();
+  release(&disk.vdisk_lock);
+}
+
+// Wait for virtio_disk_intr() to say b's request has finished.
+void virtio_disk_wait(struct buf *b) {
+  acquire(&disk.vdisk_lock);
   while (b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+// Read or write b and wait for the disk to finish.
+void virtio_disk_rw(struct buf *b, int write) {
+  virtio_disk_submit(b, write);
+  virtio_disk_kick();
+  virtio_disk_wait(b);
+}
+
+// Complete every request the device has finished since
+// the last interrupt, freeing their descriptors.
 void virtio_disk_intr() {
   acquire(&disk.vdisk_lock);
 
-  while ((disk.used_idx % NUM) != (disk.used->id % NUM)) {
-    int id = disk.used->elems[disk.used_idx].id;
+  // the device won't raise another interrupt until we tell it
+  // we've seen this interrupt, which the following line does.
+  // this may race with the device writing new entries to
+  // the "used" ring, in which case we may process the new
+  // completion entries in this interrupt, and have nothing to do
+  // in the next interrupt, which is harmless.
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  __sync_synchronize();
+
+  // the device increments disk.used->id when it
+  // adds an entry to the used ring.
+  while (disk.used_idx != disk.used->id) {
+    __sync_synchronize();
+    int id = disk.used->elems[disk.used_idx % NUM].id;
 
     if (disk.info[id].status != 0) panic("virtio_disk_intr status");
 
-    disk.info[id].b->disk = 0;  // disk is done with buf
-    wakeup(disk.info[id].b);
+    // every descriptor between the header and the
+    // status holds one buffer's data.
+    for (int i = disk.desc[id].next; disk.desc[i].flags & VRING_DESC_F_NEXT; i = disk.desc[i].next) {
+      struct buf *b = disk.info[i].b;
+      disk.info[i].b = 0;
+      b->disk = 0;  // disk is done with buf
+      wakeup(b);
+      biodone(b);
+    }
+    free_chain(id);
 
-    disk.used_idx = (disk.used_idx + 1) % NUM;
+    disk.used_idx += 1;
   }
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   release(&disk.vdisk_lock);
 }
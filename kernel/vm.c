@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -19,8 +21,7 @@ extern char trampoline[];  // trampoline.S
  * create a direct-map page table for the kernel.
  */
 void kvminit() {
-  kernel_pagetable = (pagetable_t)kalloc();
-  memset(kernel_pagetable, 0, PGSIZE);
+  kernel_pagetable = (pagetable_t)kalloc_zeroed();
 
   // uart registers
   kvmmap(UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -52,9 +53,11 @@ void kvminithart() {
   sfence_vma();
 }
 
-// Return the address of the PTE in page table pagetable
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// Return the address of the PTE at level *level in page table
+// pagetable that corresponds to virtual address va, or of the
+// leaf PTE above that level that maps va, setting *level to the
+// level of the PTE returned.  If alloc!=0, create any required
+// page-table pages.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -64,20 +67,35 @@ void kvminithart() {
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
-pte_t *walk(pagetable_t pagetable, uint64 va, int alloc) {
+// A leaf PTE at level 1 maps a 2-megabyte megapage,
+// and one at level 2 a 1-gigabyte gigapage.
+static pte_t *walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level) {
   if (va >= MAXVA) panic("walk");
 
-  for (int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for (int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if (*pte & PTE_V) {
+      if (*pte & (PTE_R | PTE_W | PTE_X)) {
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if (!alloc || (pagetable = (pde_t *)kalloc()) == 0) return 0;
-      memset(pagetable, 0, PGSIZE);
+      if (!alloc || (pagetable = (pde_t *)kalloc_zeroed()) == 0) return 0;
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
+}
+
+// Return the address of the PTE in page table pagetable
+// that corresponds to virtual address va.  If alloc!=0,
+// create any required page-table pages.
+// User page tables have only 4096-byte leaves.
+pte_t *walk(pagetable_t pagetable, uint64 va, int alloc) {
+  int level = 0;
+
+  return walklevel(pagetable, va, alloc, &level);
 }
 
 // Look up a virtual address, return the physical address,
@@ -97,27 +115,42 @@ uint64 walkaddr(pagetable_t pagetable, uint64 va) {
   return pa;
 }
 
-// add a mapping to the kernel page table.
+// add a mapping to the kernel page table, using
+// megapages and gigapages where va, pa and sz allow,
+// to save page-table memory and TLB entries.
 // only used when booting.
 // does not flush TLB or enable paging.
 void kvmmap(uint64 va, uint64 pa, uint64 sz, int perm) {
-  if (mappages(kernel_pagetable, va, sz, pa, perm) != 0) panic("kvmmap");
+  uint64 a, end, size;
+  pte_t *pte;
+  int level;
+
+  a = PGROUNDDOWN(va);
+  end = PGROUNDUP(va + sz);
+  pa = PGROUNDDOWN(pa);
+  for (; a < end; a += size, pa += size) {
+    for (level = 2; level > 0; level--) {
+      size = 1L << PXSHIFT(level);
+      if (a % size == 0 && pa % size == 0 && end - a >= size) break;
+    }
+    size = 1L << PXSHIFT(level);
+    if ((pte = walklevel(kernel_pagetable, a, 1, &level)) == 0) panic("kvmmap");
+    if (*pte & PTE_V) panic("remap");
+    *pte = PA2PTE(pa) | perm | PTE_V;
+  }
 }
 
 // translate a kernel virtual address to
 // a physical address. only needed for
 // addresses on the stack.
-// assumes va is page aligned.
 uint64 kvmpa(uint64 va) {
-  uint64 off = va % PGSIZE;
   pte_t *pte;
-  uint64 pa;
+  int level = 0;
 
-  pte = walk(kernel_pagetable, va, 0);
+  pte = walklevel(kernel_pagetable, va, 0, &level);
   if (pte == 0) panic("kvmpa");
   if ((*pte & PTE_V) == 0) panic("kvmpa");
-  pa = PTE2PA(*pte);
-  return pa + off;
+  return PTE2PA(*pte) + (va & ((1L << PXSHIFT(level)) - 1));
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -138,11 +171,13 @@ int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     a += PGSIZE;
     pa += PGSIZE;
   }
+  tlbflush(pagetable, PGROUNDDOWN(va), (last - PGROUNDDOWN(va)) / PGSIZE + 1);
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never mapped, such as
+// lazily-grown memory that wasn't used, are skipped.
 // Optionally free the physical memory.
 void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free) {
   uint64 a;
@@ -151,8 +186,7 @@ void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free) {
   if ((va % PGSIZE) != 0) panic("uvmunmap: not aligned");
 
   for (a = va; a < va + npages * PGSIZE; a += PGSIZE) {
-    if ((pte = walk(pagetable, a, 0)) == 0) panic("uvmunmap: walk");
-    if ((*pte & PTE_V) == 0) panic("uvmunmap: not mapped");
+    if ((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0) continue;
     if (PTE_FLAGS(*pte) == PTE_V) panic("uvmunmap: not a leaf");
     if (do_free) {
       uint64 pa = PTE2PA(*pte);
@@ -160,15 +194,15 @@ void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free) {
     }
     *pte = 0;
   }
+  tlbflush(pagetable, va, npages);
 }
 
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t uvmcreate() {
   pagetable_t pagetable;
-  pagetable = (pagetable_t)kalloc();
+  pagetable = (pagetable_t)kalloc_zeroed();
   if (pagetable == 0) return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -179,8 +213,7 @@ void uvminit(pagetable_t pagetable, uchar *src, uint sz) {
   char *mem;
 
   if (sz >= PGSIZE) panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W | PTE_R | PTE_X | PTE_U);
   memmove(mem, src, sz);
 }
@@ -195,12 +228,11 @@ uint64 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz) {
 
   oldsz = PGROUNDUP(oldsz);
   for (a = oldsz; a < newsz; a += PGSIZE) {
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if (mem == 0) {
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if (mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W | PTE_X | PTE_R | PTE_U) != 0) {
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -250,35 +282,113 @@ void uvmfree(pagetable_t pagetable, uint64 sz) {
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory in [start, end) with a child's page table.
+// Unless share is set, writable pages become read-only and
+// copy-on-write in both; uvmcow() copies them on the first store.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
-int uvmcopy(pagetable_t old, pagetable_t new, uint64 sz) {
+int uvmcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share) {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for (i = 0; i < sz; i += PGSIZE) {
-    if ((pte = walk(old, i, 0)) == 0) panic("uvmcopy: pte should exist");
-    if ((*pte & PTE_V) == 0) panic("uvmcopy: page not present");
+  for (i = start; i < end; i += PGSIZE) {
+    if ((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0) continue;  // not used yet
+    if (!share && (*pte & PTE_W)) *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if ((mem = kalloc()) == 0) goto err;
+    if (mappages(new, i, PGSIZE, pa, flags) != 0) goto err;
+    kdup((void *)pa);
+  }
+  if (!share) tlbflush(old, start, (PGROUNDUP(end) - start) / PGSIZE);  // writable pages are now read-only
+  return 0;
+
+err:
+  if (!share) tlbflush(old, start, (i - start) / PGSIZE);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
+  return -1;
+}
+
+// Make the user page at va writable, giving the process
+// its own copy if the page is shared copy-on-write.
+// returns 0 if va is writable afterwards, -1 if it isn't
+// mapped writable or if out of memory.
+int uvmcow(pagetable_t pagetable, uint64 va) {
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+
+  if (va >= MAXVA) return -1;
+  if ((pte = walk(pagetable, va, 0)) == 0) return -1;
+  if ((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0) return -1;
+  if (*pte & PTE_W) return 0;
+  if ((*pte & PTE_COW) == 0) return -1;
+
+  pa = PTE2PA(*pte);
+  if (krefcount((void *)pa) > 1) {
+    if ((mem = kalloc()) == 0) return -1;
     memmove(mem, (char *)pa, PGSIZE);
-    if (mappages(new, i, PGSIZE, (uint64)mem, flags) != 0) {
+    *pte = PA2PTE(mem) | PTE_FLAGS(*pte);
+    kfree((void *)pa);
+  }
+  // else the other sharers have gone; the page is ours.
+  *pte = (*pte & ~PTE_COW) | PTE_W;
+  tlbflush(pagetable, PGROUNDDOWN(va), 1);
+  return 0;
+}
+
+// Handle a page fault at va in process p: map the page
+// if it is part of the program image, memory that sbrk()
+// grew, or a file mapping, and nobody has used it yet; or
+// copy a copy-on-write page on a store.  May sleep to read
+// the file.  returns 0 if the access can be retried, -1 if not.
+int uvmfault(struct proc *p, uint64 va, int write) {
+  pte_t *pte;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  if (va >= p->sz) return mmapfault(p, va, write);
+  if ((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V)) return write ? uvmcow(p->pagetable, va) : -1;
+
+  // a page of the program that nobody is storing to
+  // yet can be shared with other runs of the program.
+  if (!write && (mem = textpage(p, va)) != 0) {
+    if (mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_X | PTE_R | PTE_U | PTE_COW) != 0) {
       kfree(mem);
-      goto err;
+      return -1;
     }
+    return 0;
+  }
+
+  if ((mem = kalloc_zeroed()) == 0) return -1;
+  if (vmaload(p, va, mem) < 0 || mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_W | PTE_X | PTE_R | PTE_U) != 0) {
+    kfree(mem);
+    return -1;
   }
   return 0;
+}
 
-err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
-  return -1;
+// Like walkaddr(), but first maps any page of the
+// current process's memory that hasn't been used yet.
+static uint64 uvmaddr(pagetable_t pagetable, uint64 va) {
+  struct proc *p = myproc();
+  uint64 pa;
+
+  pa = walkaddr(pagetable, va);
+  if (pa == 0 && p && pagetable == p->pagetable && uvmfault(p, va, 0) == 0) pa = walkaddr(pagetable, va);
+  return pa;
+}
+
+// Make the user page at va writable, as a store to it
+// would: copy it if it is copy-on-write, and for the current
+// process, map it or mark a shared file page dirty.
+// returns 0 if va is writable afterwards, -1 if not.
+static int uvmwritable(pagetable_t pagetable, uint64 va) {
+  struct proc *p = myproc();
+
+  if (p && pagetable == p->pagetable) return uvmfault(p, va, 1);
+  return uvmcow(pagetable, va);
 }
 
 // mark a PTE invalid for user access.
@@ -299,6 +409,7 @@ int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
 
   while (len > 0) {
     va0 = PGROUNDDOWN(dstva);
+    if (uvmwritable(pagetable, va0) < 0) return -1;
     pa0 = walkaddr(pagetable, va0);
     if (pa0 == 0) return -1;
     n = PGSIZE - (dstva - va0);
@@ -320,7 +431,7 @@ int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
 
   while (len > 0) {
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0);
     if (pa0 == 0) return -1;
     n = PGSIZE - (srcva - va0);
     if (n > len) n = len;
@@ -343,7 +454,7 @@ int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
 
   while (got_null == 0 && max > 0) {
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0);
     if (pa0 == 0) return -1;
     n = PGSIZE - (srcva - va0);
     if (n > max) n = max;
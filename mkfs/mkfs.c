@@ -73,8 +73,19 @@ int main(int argc, char *argv[]) {
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if (argc > 2 && strcmp(argv[1], "-l") == 0) {
+    nlog = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+
   if (argc < 2) {
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+
+  if (nlog < MAXOPBLOCKS + 1 || nlog > LOGMAX + 1) {
+    fprintf(stderr, "mkfs: log must have %d to %d blocks\n", MAXOPBLOCKS + 1, (int)LOGMAX + 1);
     exit(1);
   }
 
@@ -0,0 +1,43 @@
+// Print the file system log's statistics.
+// "logstat cmd args..." runs cmd and prints what it added.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/logstat.h"
+#include "user/user.h"
+
+int main(int argc, char *argv[]) {
+  struct logstat a, b;
+
+  memset(&a, 0, sizeof(a));
+  if (argc > 1) {
+    if (logstat(&a) < 0) {
+      fprintf(2, "logstat: failed\n");
+      exit(1);
+    }
+    int pid = fork();
+    if (pid < 0) {
+      fprintf(2, "logstat: fork failed\n");
+      exit(1);
+    }
+    if (pid == 0) {
+      exec(argv[1], argv + 1);
+      fprintf(2, "logstat: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0, 0);
+  }
+  if (logstat(&b) < 0) {
+    fprintf(2, "logstat: failed\n");
+    exit(1);
+  }
+
+  uint64 ncommit = b.ncommit - a.ncommit;
+  uint64 nblock = b.nblock - a.nblock;
+  uint64 nrun = b.nrun - a.nrun;
+  printf("commits %l, log writes %l, absorbed %l\n", ncommit, b.nwrite - a.nwrite, b.nabsorb - a.nabsorb);
+  printf("blocks %l (max %l per commit), install requests %l\n", nblock, b.maxblock, nrun);
+  printf("commit ticks %l (max %l)\n", b.ticks - a.ticks, b.maxticks);
+  if (ncommit > 0 && nrun > 0) printf("blocks per commit %l, per request %l\n", nblock / ncommit, nblock / nrun);
+  exit(0);
+}
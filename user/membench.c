@@ -0,0 +1,110 @@
+// Time kernel paths that spend most of their time in
+// memset() and memmove(): file reads and writes through
+// the buffer cache, pipes, populating and freeing memory,
+// and copy-on-write faults after fork.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define FILESZ (64 * 1024)
+#define MEMSZ (1024 * 1024)
+#define PAGE 4096
+
+static char buf[FILESZ];
+
+static void fileio(int rounds) {
+  int fd, i;
+
+  if ((fd = open("membench.tmp", O_CREATE | O_RDWR)) < 0) {
+    fprintf(2, "membench: open failed\n");
+    exit(1);
+  }
+  if (write(fd, buf, FILESZ) != FILESZ) {
+    fprintf(2, "membench: write failed\n");
+    exit(1);
+  }
+  close(fd);
+  for (i = 0; i < rounds; i++) {
+    fd = open("membench.tmp", O_RDONLY);
+    if (read(fd, buf, FILESZ) != FILESZ) {
+      fprintf(2, "membench: read failed\n");
+      exit(1);
+    }
+    close(fd);
+  }
+  unlink("membench.tmp");
+}
+
+static void pipeio(int rounds) {
+  int fds[2], pid, n;
+  long total = 0;
+
+  if (pipe(fds) < 0 || (pid = fork()) < 0) {
+    fprintf(2, "membench: pipe failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    for (int i = 0; i < rounds; i++) write(fds[1], buf, FILESZ);
+    exit(0);
+  }
+  close(fds[1]);
+  while ((n = read(fds[0], buf, FILESZ)) > 0) total += n;
+  close(fds[0]);
+  wait(0, 0);
+  if (total != (long)rounds * FILESZ) {
+    fprintf(2, "membench: pipe lost data\n");
+    exit(1);
+  }
+}
+
+static void populate(int rounds) {
+  for (int i = 0; i < rounds; i++) {
+    if (sbrkx(MEMSZ, SBRK_POPULATE) == (char *)-1) {
+      fprintf(2, "membench: sbrkx failed\n");
+      exit(1);
+    }
+    sbrk(-MEMSZ);
+  }
+}
+
+static void cowcopy(int rounds) {
+  char *p;
+
+  if ((p = sbrkx(MEMSZ, SBRK_POPULATE)) == (char *)-1) {
+    fprintf(2, "membench: sbrkx failed\n");
+    exit(1);
+  }
+  for (int i = 0; i < rounds; i++) {
+    int pid = fork();
+    if (pid < 0) {
+      fprintf(2, "membench: fork failed\n");
+      exit(1);
+    }
+    if (pid == 0) {
+      for (int off = 0; off < MEMSZ; off += PAGE) p[off] = 1;
+      exit(0);
+    }
+    wait(0, 0);
+  }
+  sbrk(-MEMSZ);
+}
+
+static void run(char *name, void (*fn)(int), int rounds) {
+  int start = uptime();
+  fn(rounds);
+  printf("%s: %d rounds, %d ticks\n", name, rounds, uptime() - start);
+}
+
+int main(int argc, char *argv[]) {
+  int rounds = 50;
+
+  if (argc > 1) rounds = atoi(argv[1]);
+  run("file read (64KB)", fileio, rounds * 4);
+  run("pipe (64KB)", pipeio, rounds * 4);
+  run("populate+free (1MB)", populate, rounds);
+  run("fork+cow (1MB)", cowcopy, rounds);
+  exit(0);
+}
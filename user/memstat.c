@@ -0,0 +1,28 @@
+// Print how the kernel's free memory is held, to watch
+// physical memory fragmentation.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+int main(int argc, char *argv[]) {
+  struct memstat st;
+  uint64 pages, free = 0, largest = 0;
+
+  if (memstat(&st) < 0) {
+    fprintf(2, "memstat: failed\n");
+    exit(1);
+  }
+
+  printf("order  blocks  pages\n");
+  for (int k = 0; k < NORDER; k++) {
+    pages = st.nblock[k] << k;
+    printf("%d  %l  %l\n", k, st.nblock[k], pages);
+    free += pages;
+    if (st.nblock[k] > 0) largest = k;
+  }
+  printf("buddy free %l pages, largest block order %l\n", free, largest);
+  printf("cpu caches %l, zeroed %l, never used %l\n", st.ncached, st.nzeroed, st.nuntouched);
+  exit(0);
+}
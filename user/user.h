@@ -1,5 +1,8 @@
 struct stat;
 struct rtcdate;
+struct logstat;
+struct memstat;
+struct iovec;
 
 // system calls
 int fork(void);
@@ -25,6 +28,17 @@ int sleep(int);
 int uptime(void);
 int rename(const char*);
 int yield(void);
+int logstat(struct logstat*);
+char* sbrkx(int, int);
+int memstat(struct memstat*);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int fcntl(int, int, int);
+int splice(int, int, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/uio.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2379,6 +2380,375 @@ void execout(char *s) {
   exit(0);
 }
 
+// sbrk() only reserves address space, so a process can grow
+// far beyond physical memory and use a few pages of it.
+// sbrkx(SBRK_POPULATE) allocates up front.
+void lazysbrk(char *s) {
+  uint64 n = 1024 * 1024 * 1024;
+  char *p = sbrk(n);
+  if (p == (char *)-1) {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  p[0] = 1;
+  p[n / 2] = 2;
+  p[n - 1] = 3;
+  if (p[0] != 1 || p[n / 2] != 2 || p[n - 1] != 3 || p[4096] != 0) {
+    printf("%s: wrong contents\n", s);
+    exit(1);
+  }
+  sbrk(-n);
+
+  n = 16 * 4096;
+  p = sbrkx(n, SBRK_POPULATE);
+  if (p == (char *)-1) {
+    printf("%s: sbrkx failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < n; i += 4096) {
+    if (p[i] != 0) {
+      printf("%s: sbrkx memory not zeroed\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-n);
+}
+
+// fork shares pages copy-on-write; stores by the child,
+// including the kernel's copyout() for read(), must not
+// be seen by the parent.
+void cowfork(char *s) {
+  int n = 256 * 4096;
+  int fds[2];
+  char *p = sbrk(n);
+  if (p == (char *)-1) {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < n; i += 4096) p[i] = 'a';
+
+  if (pipe(fds) < 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    for (int i = 0; i < n; i += 4096) p[i] = 'b';
+    write(fds[1], "c", 1);
+    if (read(fds[0], p + 4096 * 7, 1) != 1 || p[4096 * 7] != 'c') exit(1);
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus, 0);
+  if (xstatus != 0) {
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < n; i += 4096) {
+    if (p[i] != 'a') {
+      printf("%s: parent saw child's store\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-n);
+}
+
+// grow and shrink a pipe's buffer with fcntl(); what is
+// buffered must survive, and fstat() must report it.
+void pipesize(char *s) {
+  int fds[2], n;
+  struct stat st;
+  char buf[64];
+
+  if (pipe(fds) < 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if (fcntl(fds[0], F_GETPIPE_SZ, 0) != 4096) {
+    printf("%s: wrong default size\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < 3000; i++) {
+    char c = 'a' + i % 26;
+    if (write(fds[1], &c, 1) != 1) exit(1);
+  }
+  if (fstat(fds[0], &st) < 0 || st.type != T_PIPE || st.size != 3000 || st.cap != 4096) {
+    printf("%s: wrong fstat\n", s);
+    exit(1);
+  }
+  if (read(fds[0], buf, 10) != 10 || fcntl(fds[1], F_SETPIPE_SZ, 20000) != 32768) {
+    printf("%s: grow failed\n", s);
+    exit(1);
+  }
+  if (fcntl(fds[1], F_SETPIPE_SZ, 1 << 30) >= 0) {
+    printf("%s: huge size allowed\n", s);
+    exit(1);
+  }
+  for (int i = 10; i < 3000; i += n) {
+    if ((n = read(fds[0], buf, sizeof(buf))) <= 0) {
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for (int j = 0; j < n; j++) {
+      if (buf[j] != 'a' + (i + j) % 26) {
+        printf("%s: wrong data after resize\n", s);
+        exit(1);
+      }
+    }
+  }
+  if (fcntl(fds[0], F_SETPIPE_SZ, 1) != 4096) {
+    printf("%s: shrink failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// growing pipes with F_SETPIPE_SZ stops at the system-wide
+// budget, and closing them gives the pages back.
+void pipebudget(char *s) {
+  int fds[6][2], n, refused = 0;
+
+  for (n = 0; n < 6; n++) {
+    if (pipe(fds[n]) < 0) {
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    if (fcntl(fds[n][1], F_SETPIPE_SZ, 1 << 20) < 0) {
+      if (n == 0) {
+        printf("%s: first grow refused\n", s);
+        exit(1);
+      }
+      refused = 1;
+      n++;
+      break;
+    }
+  }
+  if (!refused) {
+    printf("%s: pipes grew to %d MB\n", s, n);
+    exit(1);
+  }
+  while (n-- > 0) {
+    close(fds[n][0]);
+    close(fds[n][1]);
+  }
+
+  if (pipe(fds[0]) < 0 || fcntl(fds[0][1], F_SETPIPE_SZ, 1 << 20) != 1 << 20) {
+    printf("%s: budget not given back\n", s);
+    exit(1);
+  }
+  close(fds[0][0]);
+  close(fds[0][1]);
+}
+
+// splice() a file into a pipe, through a second pipe,
+// and out into another file.
+void splicetest(char *s) {
+  int n = 10000, a[2], b[2], fd, out, r;
+  char c;
+
+  unlink("splice.in");
+  unlink("splice.out");
+  fd = open("splice.in", O_CREATE | O_RDWR);
+  for (int i = 0; i < n; i++) {
+    c = 'a' + i % 23;
+    write(fd, &c, 1);
+  }
+  close(fd);
+  if (pipe(a) < 0 || pipe(b) < 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  int pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    close(a[0]);
+    fd = open("splice.in", O_RDONLY);
+    while ((r = splice(fd, a[1], 3000)) > 0)
+      ;
+    exit(r < 0);
+  }
+  close(a[1]);
+  pid = fork();
+  if (pid == 0) {
+    close(b[0]);
+    while ((r = splice(a[0], b[1], 5000)) > 0)
+      ;
+    exit(r < 0);
+  }
+  close(a[0]);
+  close(b[1]);
+  out = open("splice.out", O_CREATE | O_WRONLY);
+  int tot = 0;
+  while ((r = splice(b[0], out, 4096)) > 0) tot += r;
+  close(out);
+  close(b[0]);
+  for (int i = 0; i < 2; i++) {
+    int xstatus;
+    wait(&xstatus, 0);
+    if (xstatus != 0) {
+      printf("%s: splice failed in child\n", s);
+      exit(1);
+    }
+  }
+  if (r < 0 || tot != n) {
+    printf("%s: spliced %d bytes, not %d\n", s, tot, n);
+    exit(1);
+  }
+  fd = open("splice.out", O_RDONLY);
+  for (int i = 0; i < n; i++) {
+    if (read(fd, &c, 1) != 1 || c != 'a' + i % 23) {
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("splice.in");
+  unlink("splice.out");
+}
+
+// pread()/pwrite() leave the file offset alone;
+// readv()/writev() scatter and gather in order.
+void preadv(char *s) {
+  char a[10], b[20], c[30];
+  struct iovec iov[3];
+  int fd;
+
+  unlink("preadv");
+  fd = open("preadv", O_CREATE | O_RDWR);
+  if (fd < 0) {
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  memset(a, 'a', sizeof(a));
+  memset(b, 'b', sizeof(b));
+  memset(c, 'c', sizeof(c));
+  iov[0].iov_base = a;
+  iov[0].iov_len = sizeof(a);
+  iov[1].iov_base = b;
+  iov[1].iov_len = sizeof(b);
+  iov[2].iov_base = c;
+  iov[2].iov_len = sizeof(c);
+  if (writev(fd, iov, 3) != 60) {
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+
+  // overwrite the b's with x's, then read
+  // from the offset writev() left behind.
+  if (pwrite(fd, "xxxxx", 5, 12) != 5 || pwrite(fd, "x", 1, 100) != -1) {
+    printf("%s: pwrite failed\n", s);
+    exit(1);
+  }
+  if (write(fd, "d", 1) != 1 || pread(fd, c, 1, 60) != 1 || c[0] != 'd') {
+    printf("%s: pwrite moved the offset\n", s);
+    exit(1);
+  }
+  if (pread(fd, b, 8, 8) != 8 || memcmp(b, "aabbxxxx", 8) != 0) {
+    printf("%s: pread got the wrong data\n", s);
+    exit(1);
+  }
+
+  // read it all back, scattered the other way round.
+  close(fd);
+  fd = open("preadv", O_RDONLY);
+  iov[0].iov_base = c;
+  iov[0].iov_len = sizeof(c);
+  iov[2].iov_base = a;
+  iov[2].iov_len = sizeof(a);
+  if (readv(fd, iov, 3) != 60 || c[9] != 'a' || c[12] != 'x' || c[29] != 'b' || a[0] != 'c') {
+    printf("%s: readv failed\n", s);
+    exit(1);
+  }
+  if (readv(fd, iov, 3) != 1 || c[0] != 'd' || readv(fd, iov, 3) != 0) {
+    printf("%s: readv past the end failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("preadv");
+}
+
+// mmap() a file: read it in place, share stores with the
+// file and a child through MAP_SHARED, keep them private
+// with MAP_PRIVATE.
+void mmapfile(char *s) {
+  int n = 3 * 4096 + 100, fd, xstatus;
+  char *p, *q;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE | O_RDWR);
+  if (fd < 0) {
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < n; i++) {
+    char c = 'a' + i % 26;
+    if (write(fd, &c, 1) != 1) {
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, n, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == (char *)-1 || q == (char *)-1) {
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < n; i++) {
+    if (p[i] != 'a' + i % 26 || q[i] != 'a' + i % 26) {
+      printf("%s: wrong contents at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if (p[n] != 0) {
+    printf("%s: past end of file not zero\n", s);
+    exit(1);
+  }
+
+  int pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    p[4096] = 'X';
+    q[4096] = 'Y';
+    exit(0);
+  }
+  wait(&xstatus, 0);
+  if (xstatus != 0 || p[4096] != 'X' || q[4096] != 'a' + 4096 % 26) {
+    printf("%s: fork sharing wrong\n", s);
+    exit(1);
+  }
+  p[0] = 'Z';
+  q[1] = 'W';
+  if (munmap(p, n) < 0 || munmap(q, n) < 0) {
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  char buf[2];
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  if (read(fd, buf, 2) != 2 || buf[0] != 'Z' || buf[1] != 'b') {
+    printf("%s: stores not written back correctly\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+}
+
 //
 // use sbrk() to count how many free physical memory pages there are.
 // touches the pages to force allocation.
@@ -2486,6 +2856,13 @@ int main(int argc, char *argv[]) {
     char *s;
   } tests[] = {
       {execout, "execout"},
+      {cowfork, "cowfork"},
+      {lazysbrk, "lazysbrk"},
+      {mmapfile, "mmapfile"},
+      {pipesize, "pipesize"},
+      {pipebudget, "pipebudget"},
+      {splicetest, "splice"},
+      {preadv, "preadv"},
       {copyin, "copyin"},
       {copyout, "copyout"},
       {copyinstr1, "copyinstr1"},
@@ -38,3 +38,14 @@ entry("sleep");
 entry("uptime");
 entry("rename");
 entry("yield");
+entry("logstat");
+entry("sbrkx");
+entry("memstat");
+entry("mmap");
+entry("munmap");
+entry("fcntl");
+entry("splice");
+entry("readv");
+entry("writev");
+entry("pread");
+entry("pwrite");